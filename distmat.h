@@ -1,24 +1,45 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cinttypes>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
 #include <stdexcept>
 #include <system_error>
 #include <type_traits>
 #include <vector>
 #include <thread>
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+#ifdef __linux__
+#  include <pthread.h>
+#  include <sched.h>
+#endif
 #if ZWRAP_USE_ZSTD
 #  include "zstd_zlibwrapper.h"
 #else
 #  include <zlib.h>
 #endif
 #include "unistd.h"
+#include <fcntl.h>
 #include "./mio.hpp"
 
 #ifndef INLINE
@@ -143,11 +164,543 @@ DEC_MAGIC(int32_t,"int32_t", INT32_T);
 DEC_MAGIC(int64_t,"int64_t", INT64_T);
 DEC_MAGIC(__int128_t,"int128_t", INT128_T);
 
+// Set in the magic byte of matrices stored column by column (GrowableDistanceMatrix).
+static constexpr uint8_t COLUMN_MAJOR_FLAG = 0x80;
+// Set in the magic byte of rectangular matrices (RectDistanceMatrix), whose header holds both dimensions.
+static constexpr uint8_t RECTANGULAR_FLAG = 0x40;
+
+inline const char *magic_name(int magic) {
+    return magic >= 0 && size_t(magic) < std::size(arr) ? arr[magic]: "unknown";
+}
+
 } // namespace more_magic
 
 #undef DEC_MAGIC
 
 
+/* *
+ * Executors run the parallel parts of distmat.
+ * Every parallel routine takes an Executor & (defaulting to default_executor()),
+ * so that embedding applications can route all work through their own pool
+ * instead of stacking OpenMP regions and ad-hoc threads on top of it.
+ *
+ * for_each_range(n, grain, f) calls f(begin, end, tid) over disjoint chunks covering [0, n)
+ * and returns when all chunks are done. tid is unique among concurrently running chunks of one call
+ * and always < concurrency(), so callers can index per-thread scratch with it.
+ * async(f) runs f in the background (or inline, if the executor has no spare threads).
+*/
+class Executor {
+public:
+    using range_function = std::function<void(size_t, size_t, unsigned)>;
+    virtual ~Executor() {}
+    virtual unsigned concurrency() const = 0;
+    virtual void for_each_range(size_t n, size_t grain, const range_function &func) = 0;
+    virtual std::future<void> async(std::function<void()> func) = 0;
+    size_t default_grain(size_t n) const {
+        return std::max(size_t(1), n / (size_t(concurrency()) * 16));
+    }
+};
+
+namespace detail {
+inline std::future<void> ready_future(const std::function<void()> &func) {
+    std::promise<void> p;
+    try {
+        func();
+        p.set_value();
+    } catch(...) {
+        p.set_exception(std::current_exception());
+    }
+    return p.get_future();
+}
+
+/*
+ * State shared by every participant in a single for_each_range call.
+ * Chunks are claimed with an atomic counter; whoever arrives late finds nothing left and leaves.
+ */
+struct RangeJob {
+    const Executor::range_function &func_;
+    const size_t n_, grain_, nchunks_;
+    std::atomic<size_t> next_{0}, done_{0};
+    std::atomic<unsigned> ntids_{0};
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::exception_ptr exc_;
+    RangeJob(size_t n, size_t grain, const Executor::range_function &func):
+        func_(func), n_(n), grain_(std::max(grain, size_t(1))), nchunks_((n_ + grain_ - 1) / grain_) {}
+    void run() {
+        size_t ci = next_.fetch_add(1, std::memory_order_relaxed);
+        if(ci >= nchunks_) return;
+        const unsigned tid = ntids_.fetch_add(1, std::memory_order_relaxed);
+        size_t ndone = 0;
+        for(; ci < nchunks_; ci = next_.fetch_add(1, std::memory_order_relaxed), ++ndone) {
+            const size_t b = ci * grain_;
+            try {
+                func_(b, std::min(b + grain_, n_), tid);
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(m_);
+                if(!exc_) exc_ = std::current_exception();
+            }
+        }
+        if(done_.fetch_add(ndone, std::memory_order_acq_rel) + ndone == nchunks_) {
+            std::lock_guard<std::mutex> lock(m_);
+            cv_.notify_all();
+        }
+    }
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [this]() {return done_.load(std::memory_order_acquire) == nchunks_;});
+        if(exc_) std::rethrow_exception(exc_);
+    }
+};
+
+inline void pin_thread(std::thread::native_handle_type handle, int cpu) {
+#ifdef __linux__
+    if(cpu < 0 || cpu >= CPU_SETSIZE) throw std::invalid_argument("CPU index out of range: " + std::to_string(cpu));
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(int rc = ::pthread_setaffinity_np(handle, sizeof(set), &set))
+        throw std::system_error(rc, std::system_category(), "Failed to set thread affinity");
+#else
+    (void)handle; (void)cpu;
+#endif
+}
+} // namespace detail
+
+class SerialExecutor: public Executor {
+public:
+    unsigned concurrency() const override {return 1;}
+    void for_each_range(size_t n, size_t, const range_function &func) override {
+        if(n) func(0, n, 0);
+    }
+    std::future<void> async(std::function<void()> func) override {
+        return detail::ready_future(func);
+    }
+};
+
+/* *
+ * ThreadPool is a persistent pool of nthreads - 1 workers; the thread calling for_each_range
+ * participates, so concurrency() == nthreads. Workers can be pinned to CPUs with cpus
+ * (worker i gets cpus[i % cpus.size()]).
+ * Nested for_each_range calls from inside a task are safe: the caller can always finish the job alone.
+ * Waiting on an async future from inside a pool task is not: once every worker is blocked that way,
+ * the queued tasks they wait for never run. So do not call parallel_fill, stream_fill or other functions
+ * using async on a pool from one of that pool's own tasks.
+*/
+class ThreadPool: public Executor {
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> queue_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for(auto &w: workers_) w.join();
+    }
+    void work() {
+        for(;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_);
+                cv_.wait(lock, [this]() {return stop_ || !queue_.empty();});
+                if(queue_.empty()) return;
+                task = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            task();
+        }
+    }
+public:
+    explicit ThreadPool(unsigned nthreads=0, const std::vector<int> &cpus=std::vector<int>()) {
+        if(nthreads == 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+        workers_.reserve(nthreads - 1);
+        try {
+            for(unsigned i = 0; i + 1 < nthreads; ++i) {
+                workers_.emplace_back([this]() {work();});
+                if(!cpus.empty()) detail::pin_thread(workers_.back().native_handle(), cpus[i % cpus.size()]);
+            }
+        } catch(...) {
+            // The destructor won't run, so stop the workers already started before rethrowing.
+            shutdown();
+            throw;
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    ~ThreadPool() {shutdown();}
+    unsigned concurrency() const override {return workers_.size() + 1;}
+    void enqueue(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            queue_.emplace_back(std::move(task));
+        }
+        cv_.notify_one();
+    }
+    void for_each_range(size_t n, size_t grain, const range_function &func) override {
+        if(!n) return;
+        if(!grain) grain = default_grain(n);
+        auto job = std::make_shared<detail::RangeJob>(n, grain, func);
+        const size_t nhelpers = std::min(workers_.size(), job->nchunks_ - 1);
+        for(size_t i = 0; i < nhelpers; ++i)
+            enqueue([job]() {job->run();});
+        job->run();
+        job->wait();
+    }
+    std::future<void> async(std::function<void()> func) override {
+        if(workers_.empty()) return detail::ready_future(func);
+        auto task = std::make_shared<std::packaged_task<void()>>(std::move(func));
+        auto ret = task->get_future();
+        enqueue([task]() {(*task)();});
+        return ret;
+    }
+};
+
+/* *
+ * OpenMPExecutor maps for_each_range onto an OpenMP parallel region with nthreads threads
+ * (0 means omp_get_max_threads()). Without OpenMP it runs serially.
+ * async tasks run on an owned ThreadPool of up to four helper threads.
+*/
+class OpenMPExecutor: public Executor {
+    unsigned nthreads_;
+    // Persistent threads for async tasks (batch copies, block compression), so none are started per call.
+    std::unique_ptr<ThreadPool> helpers_;
+public:
+    explicit OpenMPExecutor(unsigned nthreads=0): nthreads_(nthreads) {
+#ifdef _OPENMP
+        if(!nthreads_) nthreads_ = omp_get_max_threads();
+#else
+        nthreads_ = 1;
+#endif
+        helpers_.reset(new ThreadPool(std::min(nthreads_, 4u) + 1));
+    }
+    unsigned concurrency() const override {return nthreads_;}
+    void for_each_range(size_t n, size_t grain, const range_function &func) override {
+        if(!n) return;
+        if(!grain) grain = default_grain(n);
+#ifdef _OPENMP
+        const size_t nchunks = (n + grain - 1) / grain;
+        std::exception_ptr exc;
+        #pragma omp parallel for schedule(dynamic) num_threads(nthreads_)
+        for(size_t ci = 0; ci < nchunks; ++ci) {
+            try {
+                func(ci * grain, std::min((ci + 1) * grain, n), omp_get_thread_num());
+            } catch(...) {
+                #pragma omp critical
+                if(!exc) exc = std::current_exception();
+            }
+        }
+        if(exc) std::rethrow_exception(exc);
+#else
+        func(0, n, 0);
+#endif
+    }
+    std::future<void> async(std::function<void()> func) override {
+        return helpers_->async(std::move(func));
+    }
+};
+
+/* *
+ * ExternalExecutor adapts a caller-owned pool.
+ * submit must eventually run every task it is given; nthreads is the number of
+ * pool threads we may occupy at once (the calling thread is counted on top of that).
+*/
+class ExternalExecutor: public Executor {
+    std::function<void(std::function<void()>)> submit_;
+    unsigned nthreads_;
+public:
+    ExternalExecutor(std::function<void(std::function<void()>)> submit, unsigned nthreads):
+        submit_(std::move(submit)), nthreads_(nthreads) {}
+    unsigned concurrency() const override {return nthreads_ + 1;}
+    void for_each_range(size_t n, size_t grain, const range_function &func) override {
+        if(!n) return;
+        if(!grain) grain = default_grain(n);
+        auto job = std::make_shared<detail::RangeJob>(n, grain, func);
+        const size_t nhelpers = std::min(size_t(nthreads_), job->nchunks_ - 1);
+        for(size_t i = 0; i < nhelpers; ++i)
+            submit_([job]() {job->run();});
+        job->run();
+        job->wait();
+    }
+    std::future<void> async(std::function<void()> func) override {
+        auto task = std::make_shared<std::packaged_task<void()>>(std::move(func));
+        auto ret = task->get_future();
+        submit_([task]() {(*task)();});
+        return ret;
+    }
+};
+
+namespace detail {
+inline Executor *&default_executor_ptr() {
+    static Executor *ptr = nullptr;
+    return ptr;
+}
+} // namespace detail
+
+// Replaces the executor used when none is passed. Pass nullptr to restore the built-in one.
+inline void set_default_executor(Executor *ex) {detail::default_executor_ptr() = ex;}
+
+inline Executor &default_executor() {
+    if(Executor *ex = detail::default_executor_ptr()) return *ex;
+#ifdef _OPENMP
+    static OpenMPExecutor ex;
+#else
+    static ThreadPool ex;
+#endif
+    return ex;
+}
+
+// Calls func(i, tid) for every i in [0, n).
+template<typename Func>
+void parallel_for(Executor &ex, size_t n, const Func &func, size_t grain=0) {
+    ex.for_each_range(n, grain, [&func](size_t b, size_t e, unsigned tid) {
+        for(size_t i = b; i < e; ++i) func(i, tid);
+    });
+}
+
+/* *
+ * Instrumentation collects progress and throughput counters from parallel_fill, write() and read().
+ * Routines take an Instrumentation * which defaults to nullptr; when it is null nothing is measured
+ * and the only cost is a pointer test per batch or I/O chunk.
+ *
+ * Counters are lock-free and may be read from any thread while a job runs.
+ * Per-thread busy/idle times are indexed by executor tid, not by OS thread.
+ * If a callback is set, it is invoked (from whichever thread is reporting) at most once per interval,
+ * plus once when a job finishes.
+*/
+struct ProgressCounters {
+    std::atomic<uint64_t> pairs_total{0};      // pairs the current fill will compute, for ETA
+    std::atomic<uint64_t> pairs_computed{0};
+    std::atomic<uint64_t> bytes_uncompressed{0}; // payload bytes passed to/from the (de)compressor
+    std::atomic<uint64_t> bytes_written{0};    // bytes reaching the file, compressed size if compressing
+    std::atomic<uint64_t> bytes_read{0};       // bytes consumed from the file
+    std::atomic<uint64_t> copy_ns{0};          // time spent copying finished batches out
+    std::atomic<uint64_t> copy_stall_ns{0};    // time compute waited for the previous copy to finish
+};
+
+class Instrumentation {
+public:
+    using clock = std::chrono::steady_clock;
+    using callback_type = std::function<void(const Instrumentation &)>;
+    ProgressCounters counters;
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> busy_ns_, idle_ns_;
+    unsigned nthreads_ = 0;
+    callback_type callback_;
+    const clock::time_point start_;
+    const uint64_t interval_ns_;
+    std::atomic<uint64_t> last_report_ns_{0};
+public:
+    Instrumentation(callback_type callback=callback_type(), std::chrono::milliseconds interval=std::chrono::milliseconds(1000)):
+        callback_(std::move(callback)), start_(clock::now()), interval_ns_(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count()) {}
+    static uint64_t ns_since(clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t).count();
+    }
+    uint64_t elapsed_ns() const {return ns_since(start_);}
+    double elapsed_seconds() const {return elapsed_ns() * 1e-9;}
+    // Sizes the per-thread arrays; called by routines before they start timing threads.
+    void prepare_threads(unsigned nthreads) {
+        if(nthreads <= nthreads_) return;
+        auto nb = std::make_unique<std::atomic<uint64_t>[]>(nthreads), ni = std::make_unique<std::atomic<uint64_t>[]>(nthreads);
+        for(unsigned i = 0; i < nthreads; ++i) {
+            nb[i] = i < nthreads_ ? busy_ns_[i].load(): uint64_t(0);
+            ni[i] = i < nthreads_ ? idle_ns_[i].load(): uint64_t(0);
+        }
+        busy_ns_ = std::move(nb); idle_ns_ = std::move(ni);
+        nthreads_ = nthreads;
+    }
+    unsigned nthreads() const {return nthreads_;}
+    uint64_t busy_ns(unsigned tid) const {return busy_ns_[tid].load(std::memory_order_relaxed);}
+    uint64_t idle_ns(unsigned tid) const {return idle_ns_[tid].load(std::memory_order_relaxed);}
+    void add_busy(unsigned tid, uint64_t ns) {busy_ns_[tid].fetch_add(ns, std::memory_order_relaxed);}
+    void add_idle(unsigned tid, uint64_t ns) {idle_ns_[tid].fetch_add(ns, std::memory_order_relaxed);}
+    double pairs_per_second() const {
+        const double t = elapsed_seconds();
+        return t > 0. ? counters.pairs_computed.load() / t: 0.;
+    }
+    // Seconds remaining at the current rate, or a negative value if unknown.
+    double eta_seconds() const {
+        const uint64_t done = counters.pairs_computed.load(), total = counters.pairs_total.load();
+        if(!done || total < done) return -1.;
+        return elapsed_seconds() * double(total - done) / done;
+    }
+    void report(bool force=false) {
+        if(!callback_) return;
+        const uint64_t now = elapsed_ns();
+        uint64_t last = last_report_ns_.load(std::memory_order_relaxed);
+        if(!force && (now - last < interval_ns_ || !last_report_ns_.compare_exchange_strong(last, now)))
+            return;
+        if(force) last_report_ns_.store(now, std::memory_order_relaxed);
+        callback_(*this);
+    }
+};
+
+namespace detail {
+/*
+ * Wraps func for an Executor::for_each_range call so that busy time per tid is recorded in ins.
+ * The caller passes the region's wall time to finish() to turn the rest into idle time.
+ */
+class RegionTimer {
+    Instrumentation *ins_;
+    std::vector<uint64_t> busy_;
+    Instrumentation::clock::time_point start_;
+public:
+    RegionTimer(Instrumentation *ins, unsigned nthreads): ins_(ins), busy_(ins ? nthreads: 0) {
+        if(ins_) start_ = Instrumentation::clock::now();
+    }
+    template<typename Func>
+    void run(Executor &ex, size_t n, size_t grain, const Func &func) {
+        if(!ins_) {
+            ex.for_each_range(n, grain, func);
+            return;
+        }
+        ex.for_each_range(n, grain, [&](size_t b, size_t e, unsigned tid) {
+            const auto t = Instrumentation::clock::now();
+            func(b, e, tid);
+            busy_[tid] += Instrumentation::ns_since(t);
+        });
+        const uint64_t wall = Instrumentation::ns_since(start_);
+        for(unsigned i = 0; i < busy_.size(); ++i) {
+            ins_->add_busy(i, busy_[i]);
+            ins_->add_idle(i, wall > busy_[i] ? wall - busy_[i]: uint64_t(0));
+        }
+    }
+};
+} // namespace detail
+
+
+namespace detail {
+// zlib takes unsigned lengths, so large payloads are moved in chunks; this is also the progress granularity.
+static constexpr size_t IO_CHUNK_SIZE = size_t(1) << 24;
+
+inline size_t gzwrite_all(gzFile fp, const void *data, size_t nb, Instrumentation *ins=nullptr) {
+    const char *p = static_cast<const char *>(data);
+    const z_off_t start = ins ? gzoffset(fp): z_off_t(0);
+    for(size_t off = 0; off < nb;) {
+        const unsigned n = std::min(nb - off, IO_CHUNK_SIZE);
+        if(gzwrite(fp, p + off, n) != int(n)) {
+            int gret;
+            throw std::runtime_error(std::string("Failed to write to gzFile: ") + gzerror(fp, &gret));
+        }
+        off += n;
+        if(ins) {
+            ins->counters.bytes_uncompressed.fetch_add(n, std::memory_order_relaxed);
+            ins->report();
+        }
+    }
+    if(ins) ins->counters.bytes_written.fetch_add(gzoffset(fp) - start, std::memory_order_relaxed);
+    return nb;
+}
+
+inline size_t gzread_all(gzFile fp, void *data, size_t nb, Instrumentation *ins=nullptr) {
+    char *p = static_cast<char *>(data);
+    const z_off_t start = ins ? gzoffset(fp): z_off_t(0);
+    for(size_t off = 0; off < nb;) {
+        const unsigned n = std::min(nb - off, IO_CHUNK_SIZE);
+        const int rc = gzread(fp, p + off, n);
+        if(rc <= 0) {
+            int gret;
+            const char *os = gzerror(fp, &gret);
+            throw std::runtime_error(std::string("Failed to read from gzFile: ") + (rc ? os: "unexpected end of file"));
+        }
+        off += rc;
+        if(ins) {
+            ins->counters.bytes_uncompressed.fetch_add(rc, std::memory_order_relaxed);
+            ins->report();
+        }
+    }
+    if(ins) ins->counters.bytes_read.fetch_add(gzoffset(fp) - start, std::memory_order_relaxed);
+    return nb;
+}
+
+inline size_t write_all(int fd, const void *data, size_t nb, Instrumentation *ins=nullptr) {
+    const char *p = static_cast<const char *>(data);
+    for(size_t off = 0; off < nb;) {
+        const ssize_t rc = ::write(fd, p + off, std::min(nb - off, IO_CHUNK_SIZE));
+        if(rc < 0) {
+            if(errno == EINTR) continue;
+            throw std::system_error(errno, std::system_category(), ::strerror(errno));
+        }
+        off += rc;
+        if(ins) {
+            ins->counters.bytes_written.fetch_add(rc, std::memory_order_relaxed);
+            ins->report();
+        }
+    }
+    return nb;
+}
+} // namespace detail
+
+namespace detail {
+// Positions of idx in order of increasing source index, so that sources are visited in storage order.
+inline std::vector<size_t> sorted_order(const std::vector<size_t> &idx, size_t n) {
+    for(const auto i: idx)
+        if(i >= n) throw std::out_of_range(std::string("Index ") + std::to_string(i) + " out of range for matrix of size " + std::to_string(n));
+    std::vector<size_t> order(idx.size());
+    for(size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&idx](size_t x, size_t y) {return idx[x] < idx[y];});
+    return order;
+}
+
+/*
+ * Fills output row order[a] of a submatrix from source row r = idx[order[a]], whose row_span starts at rowp.
+ * Because positions after a in sorted order have source indices >= r, only the row part of r is read,
+ * front to back. diagval is used where a point was selected twice.
+ */
+template<typename T, typename OutMat>
+void subset_row(const T *rowp, size_t r, const std::vector<size_t> &idx, const std::vector<size_t> &order, size_t a, OutMat &out, T diagval) {
+    const size_t pa = order[a];
+    T *const od = out.data();
+    for(size_t b = a + 1; b < order.size(); ++b) {
+        const size_t pb = order[b], c = idx[pb];
+        od[out.index(pa, pb)] = c == r ? diagval: rowp[c - r - 1];
+    }
+}
+
+inline void check_permutation(const std::vector<size_t> &perm, size_t n) {
+    if(perm.size() != n) throw std::invalid_argument("Permutation size does not match matrix size");
+    std::vector<bool> seen(n);
+    for(const auto p: perm) {
+        if(p >= n || seen[p]) throw std::invalid_argument("Not a permutation");
+        seen[p] = true;
+    }
+}
+
+// Integer traits that also cover the 128-bit types, which std::is_integral leaves out in strict ISO mode.
+template<typename T>
+struct is_integer: std::integral_constant<bool, std::is_integral<T>::value || std::is_same<T, __int128_t>::value || std::is_same<T, __uint128_t>::value> {};
+template<typename T>
+struct is_signed_integer: std::integral_constant<bool, (std::is_integral<T>::value && std::is_signed<T>::value) || std::is_same<T, __int128_t>::value> {};
+
+// Integer to integer, clamped to To's range.
+template<typename To, typename From>
+INLINE To saturate_integer(From x) {
+    if(is_signed_integer<From>::value && x < From(0)) {
+        if(!is_signed_integer<To>::value) return To(0);
+        return __int128_t(x) < __int128_t(dm::numeric_limits<To>::min()) ? dm::numeric_limits<To>::min(): To(x);
+    }
+    return __uint128_t(x) > __uint128_t(dm::numeric_limits<To>::max()) ? dm::numeric_limits<To>::max(): To(x);
+}
+
+/*
+ * x * scale as To. Integer targets are rounded to nearest (halves away from zero) and clamped to To's range,
+ * with NaN mapped to To's maximum; integer-to-integer conversions with scale 1 skip the trip through double.
+ * Floating-point targets follow IEEE conversion.
+ */
+template<typename To, typename From>
+INLINE To saturating_cast(From x, double scale) {
+    if(!is_integer<To>::value) return To(double(x) * scale);
+    if(is_integer<From>::value && scale == 1.) return saturate_integer<To>(x);
+    const double v = double(x) * scale, lo = double(dm::numeric_limits<To>::min()), hi = double(dm::numeric_limits<To>::max());
+    if(!(v < hi)) return dm::numeric_limits<To>::max();
+    if(v <= lo) return dm::numeric_limits<To>::min();
+    return To(v < 0. ? v - .5: v + .5);
+}
+} // namespace detail
+
 /* *
  * DistanceMatrix holds an upper-triangular matrix.
  * You can access rows with row_span()
@@ -159,7 +712,7 @@ template<typename ArithType=float,
          size_t DefaultValue=0>
 class DistanceMatrix {
     ArithType *data_;
-    std::unique_ptr<ArithType> dup_;
+    std::unique_ptr<ArithType[]> dup_;
     uint64_t  nelem_, num_entries_;
     ArithType default_value_;
     std::unique_ptr<mio::mmap_sink> mfbp_;
@@ -255,16 +808,26 @@ public:
     const value_type &operator[](std::pair<size_t, size_t> &idx) const {
        return data_[index(idx.first, idx.second)];
     }
+    // Grows the matrix to new_size points, keeping existing distances.
+    // New entries are set to -1, to ensure they are calculated before use.
+    // This moves every row; GrowableDistanceMatrix appends points without moving anything.
     void resize(size_t new_size) {
         if(new_size == nelem_) return; // Already done! Aren't we fast?
         if(new_size < nelem_) throw std::runtime_error("NotImplemented: shrinking.");
         const auto nsz = (new_size * (new_size - 1)) >> 1;
         if(!dup_) throw std::runtime_error("Can't resize external data"); // Can't resize externl
+        std::unique_ptr<ArithType[]> nd(new ArithType[nsz]);
+        ArithType *dst = nd.get();
+        for(size_t i = 0; i < new_size - 1; ++i) {
+            const size_t nold = i + 1 < nelem_ ? nelem_ - i - 1: size_t(0);
+            if(nold) std::copy(row_ptr(i), row_ptr(i) + nold, dst);
+            std::fill_n(dst + nold, new_size - i - 1 - nold, static_cast<value_type>(-1));
+            dst += new_size - i - 1;
+        }
         nelem_ = new_size;
         num_entries_ = nsz;
-        dup_.reset(new ArithType[num_entries_]);
-        std::fill_n(data_, num_entries_, static_cast<value_type>(-1));
-        // Invalid -- to ensure data is calculated before use
+        dup_ = std::move(nd);
+        data_ = dup_.get();
     }
     auto begin() {return data_;}
     auto end()   {return data_ + num_entries_;}
@@ -338,38 +901,39 @@ public:
             }
         }
     }
-    size_t write(const char *path, int compression_level=0) const {
-        std::string fmt = compression_level ? std::string("wT"): (std::string("wb") + std::to_string(compression_level % 10));
+    size_t write(const char *path, int compression_level=0, Instrumentation *ins=nullptr) const {
+        std::string fmt = compression_level ? (std::string("wb") + std::to_string(compression_level % 10)): std::string("wT");
         gzFile fp = gzopen(std::strcmp(path, "-") ? path: "/dev/stdout", fmt.data());
         if(!fp) throw std::runtime_error(std::string("Could not open file at ") + path);
-        size_t ret = write(fp);
+        size_t ret = write(fp, ins);
+        if(ins) {
+            // Count what zlib still holds in its buffers.
+            const z_off_t pre = gzoffset(fp);
+            gzflush(fp, Z_FINISH);
+            ins->counters.bytes_written.fetch_add(gzoffset(fp) - pre, std::memory_order_relaxed);
+        }
         gzclose(fp);
+        if(ins) ins->report(true);
         return ret;
     }
-    size_t write(gzFile fp) const {
-        size_t ret = gzputc(fp, magic_number());
-        ret += gzwrite(fp, &nelem_, sizeof(nelem_));
-        ret += gzwrite(fp, data_, sizeof(ArithType) * num_entries_);
+    size_t write(gzFile fp, Instrumentation *ins=nullptr) const {
+        size_t ret = gzputc(fp, magic_number()) == magic_number();
+        ret += detail::gzwrite_all(fp, &nelem_, sizeof(nelem_));
+        ret += detail::gzwrite_all(fp, data_, sizeof(ArithType) * num_entries_, ins);
         return ret;
     }
-    size_t write(std::FILE *fp) const {
+    size_t write(std::FILE *fp, Instrumentation *ins=nullptr) const {
         if(__builtin_expect(fputc(magic_number(), fp) != magic_number(), 0))
             throw std::system_error(std::ferror(fp), std::system_category(), "Failed to write magic number to file");
         std::fflush(fp);
         int fn = fileno(fp);
         size_t ret = 1;
-        if(::write(fn, &nelem_, sizeof(nelem_)) != sizeof(nelem_)) {
-            throw std::system_error(errno, std::system_category(), ::strerror(errno));
-        }
-        ret += sizeof(nelem_);
-        const ssize_t nb =  sizeof(ArithType) * num_entries_;
-        if(::write(fn, data_, nb) != nb) {
-            throw std::system_error(errno, std::system_category(), ::strerror(errno));
-        }
-        ret += sizeof(ArithType) * num_entries_;
+        ret += detail::write_all(fn, &nelem_, sizeof(nelem_));
+        ret += detail::write_all(fn, data_, sizeof(ArithType) * num_entries_, ins);
+        if(ins) ins->report(true);
         return ret;
     }
-    void read(const char *path, ArithType *prevdat=static_cast<ArithType *>(nullptr), bool forcestream=false) {
+    void read(const char *path, ArithType *prevdat=static_cast<ArithType *>(nullptr), bool forcestream=false, Instrumentation *ins=nullptr) {
         // Else, open from file on disk
         using more_magic::MagicNumber;
         path = std::strcmp(path, "-") ? path: "/dev/stdin";
@@ -385,7 +949,7 @@ public:
         const MagicNumber magic = MagicNumber(gzgetc(gzfp));
         if(magic != magic_number()) {
             char buf[256];
-            std::sprintf(buf, "Wrong magic number read from file (%d/%s), expected (%d/%s)\n", magic, more_magic::arr[magic], magic_number(), magic_string());
+            std::sprintf(buf, "Wrong magic number read from file (%d/%s), expected (%d/%s)\n", magic, more_magic::magic_name(magic), magic_number(), magic_string());
             throw std::runtime_error(buf);
         }
         if(int rc = gzread(gzfp, &nelem_, sizeof(nelem_)) != sizeof(nelem_)) {
@@ -401,13 +965,156 @@ public:
             dup_.reset(new ArithType[num_entries_]);
             data_ = dup_.get();
         }
-        gzread(gzfp, data_, sizeof(ArithType) * num_entries_);
+        detail::gzread_all(gzfp, data_, sizeof(ArithType) * num_entries_, ins);
         gzclose(gzfp);
+        if(ins) ins->report(true);
         std::fclose(fp);
     }
     size_t size() const {return nelem_;}
     size_t rows() const {return nelem_;}
     size_t columns() const {return nelem_;}
+    /* *
+     * Returns the matrix restricted to the points in idx, in the order given (indices may repeat).
+     * Points are visited in sorted order, so each source row is read front to back once,
+     * and output rows are computed in parallel on ex.
+    */
+    DistanceMatrix subset(const std::vector<size_t> &idx, Executor &ex=default_executor()) const {
+        const auto order = detail::sorted_order(idx, nelem_);
+        DistanceMatrix ret(idx.size(), default_value_);
+        parallel_for(ex, order.size(), [&](size_t a, unsigned) {
+            const size_t r = idx[order[a]];
+            detail::subset_row(row_ptr(r), r, idx, order, a, ret, default_value_);
+        }, 1);
+        return ret;
+    }
+    // Offsets of each row in data(), so that entry (i, j), i < j, is at offsets[i] + j - i - 1 without a divide.
+    std::vector<size_t> row_offsets() const {
+        std::vector<size_t> ret(nelem_);
+        for(size_t i = 0; i < nelem_; ++i) ret[i] = row_ptr(i) - data_;
+        return ret;
+    }
+    /* *
+     * Returns the matrix with point a of the result being point perm[a] of this one.
+     * The output is produced in TILE x TILE tiles, one row block per task on ex,
+     * so each tile gathers from a bounded set of source rows and writes its rows sequentially.
+    */
+    DistanceMatrix permuted(const std::vector<size_t> &perm, Executor &ex=default_executor()) const {
+        static constexpr size_t TILE = 64;
+        detail::check_permutation(perm, nelem_);
+        const auto offsets = row_offsets();
+        DistanceMatrix ret(nelem_, default_value_);
+        const size_t nblocks = (nelem_ + TILE - 1) / TILE;
+        parallel_for(ex, nblocks, [&](size_t ab, unsigned) {
+            const size_t a0 = ab * TILE, a1 = std::min(a0 + TILE, size_t(nelem_));
+            for(size_t b0 = a0; b0 < nelem_; b0 += TILE) {
+                const size_t b1 = std::min(b0 + TILE, size_t(nelem_));
+                for(size_t a = a0; a < a1; ++a) {
+                    const size_t pa = perm[a];
+                    ArithType *const orow = ret.row_ptr(a);
+                    for(size_t b = std::max(b0, a + 1); b < b1; ++b) {
+                        const size_t pb = perm[b];
+                        orow[b - a - 1] = pa < pb ? data_[offsets[pa] + pb - pa - 1]: data_[offsets[pb] + pa - pb - 1];
+                    }
+                }
+            }
+        }, 1);
+        return ret;
+    }
+    /* *
+     * Applies perm in place (point a becomes point perm[a]), by following the cycles of the induced
+     * permutation of entries. Needs one bit per entry rather than a second copy, so it suits mmapped matrices.
+     * Cycle starts are visited tile by tile, which keeps short cycles (common for clustered orders) in cache.
+     * This runs serially.
+    */
+    void permute(const std::vector<size_t> &perm) {
+        static constexpr size_t TILE = 64;
+        detail::check_permutation(perm, nelem_);
+        const auto offsets = row_offsets();
+        auto flat = [&](size_t i, size_t j) {return i < j ? offsets[i] + j - i - 1: offsets[j] + i - j - 1;};
+        std::vector<uint64_t> done((num_entries_ + 63) / 64);
+        auto test_and_set = [&done](size_t e) {
+            const uint64_t bit = uint64_t(1) << (e % 64);
+            const bool ret = done[e / 64] & bit;
+            done[e / 64] |= bit;
+            return ret;
+        };
+        for(size_t a0 = 0; a0 < nelem_; a0 += TILE) {
+            for(size_t b0 = a0; b0 < nelem_; b0 += TILE) {
+                for(size_t a = a0; a < std::min(a0 + TILE, size_t(nelem_)); ++a) {
+                    for(size_t b = std::max(b0, a + 1); b < std::min(b0 + TILE, size_t(nelem_)); ++b) {
+                        const size_t start = flat(a, b);
+                        if(test_and_set(start)) continue;
+                        // Entry (x, y) receives the value at (perm[x], perm[y]).
+                        const ArithType tmp = data_[start];
+                        size_t x = a, y = b, cur = start;
+                        for(;;) {
+                            const size_t nx = perm[x], ny = perm[y], src = flat(nx, ny);
+                            if(src == start) break;
+                            data_[cur] = data_[src];
+                            test_and_set(src);
+                            cur = src, x = nx, y = ny;
+                        }
+                        data_[cur] = tmp;
+                    }
+                }
+            }
+        }
+    }
+    /* *
+     * Replaces every stored distance x with func(x) (and the default value too), in parallel chunks.
+     * Each chunk is a plain contiguous loop, so simple arithmetic functors such as OneMinus or Clamp can vectorize.
+    */
+    template<typename Func>
+    DistanceMatrix &apply(const Func &func, Executor &ex=default_executor()) {
+        ArithType *const p = data_;
+        ex.for_each_range(num_entries_, size_t(1) << 16, [&](size_t b, size_t e, unsigned) {
+            for(size_t i = b; i < e; ++i) p[i] = func(p[i]);
+        });
+        default_value_ = func(default_value_);
+        return *this;
+    }
+    // As apply, but func(i, j, x) also receives the pair, i < j. Work is split by rows.
+    template<typename Func>
+    DistanceMatrix &apply_indexed(const Func &func, Executor &ex=default_executor()) {
+        parallel_for(ex, nelem_, [&](size_t i, unsigned) {
+            auto span = row_span(i);
+            for(size_t j = 0; j < span.second; ++j) span.first[j] = func(i, i + j + 1, span.first[j]);
+        }, 16);
+        return *this;
+    }
+    /* *
+     * Writes func(x) for every entry into out, which must have the same size; out may be of another type
+     * and may be backed by a new file, so conversion happens in one streaming pass.
+    */
+    template<typename OtherT, size_t OtherDefault, typename Func>
+    void transform_into(DistanceMatrix<OtherT, OtherDefault> &out, const Func &func, Executor &ex=default_executor()) const {
+        if(out.size() != nelem_) throw std::invalid_argument("transform_into: size mismatch");
+        const ArithType *const src = data_;
+        OtherT *const dst = out.data();
+        ex.for_each_range(num_entries_, size_t(1) << 16, [&](size_t b, size_t e, unsigned) {
+            for(size_t i = b; i < e; ++i) dst[i] = func(src[i]);
+        });
+        out.set_default_value(func(default_value_));
+    }
+    template<typename OtherT, typename Func>
+    DistanceMatrix<OtherT, DefaultValue> transform_into(const Func &func, Executor &ex=default_executor()) const {
+        DistanceMatrix<OtherT, DefaultValue> ret(nelem_);
+        transform_into(ret, func, ex);
+        return ret;
+    }
+    /* *
+     * Converts to OtherT after multiplying by scale (e.g., 1000 for distances in [0, 1] stored as uint16_t).
+     * Integer targets are rounded to nearest and saturated instead of wrapping; see detail::saturating_cast.
+     * To convert without a second in-memory copy, pass a file-backed matrix to convert_into, or use convert_file.
+    */
+    template<typename OtherT>
+    DistanceMatrix<OtherT, DefaultValue> convert(double scale=1., Executor &ex=default_executor()) const {
+        return transform_into<OtherT>([scale](ArithType x) {return detail::saturating_cast<OtherT>(x, scale);}, ex);
+    }
+    template<typename OtherT, size_t OtherDefault>
+    void convert_into(DistanceMatrix<OtherT, OtherDefault> &out, double scale=1., Executor &ex=default_executor()) const {
+        transform_into(out, [scale](ArithType x) {return detail::saturating_cast<OtherT>(x, scale);}, ex);
+    }
     bool operator==(const DistanceMatrix &o) const {
         return nelem_ == o.nelem_ &&
             (data_ && o.data_ ? (std::memcmp(data_, o.data_, num_entries_ * sizeof(ArithType)) == 0)
@@ -415,28 +1122,90 @@ public:
     }
 };
 
+namespace detail {
+// madvise requires a page-aligned address; round inward and ignore failure, since it is only advice.
+inline void advise_sequential(void *ptr, size_t nbytes) {
+    static const uintptr_t pagesize = ::sysconf(_SC_PAGESIZE);
+    const uintptr_t b = (reinterpret_cast<uintptr_t>(ptr) + pagesize - 1) & ~(pagesize - 1);
+    const uintptr_t e = (reinterpret_cast<uintptr_t>(ptr) + nbytes) & ~(pagesize - 1);
+    if(b < e) ::madvise(reinterpret_cast<void *>(b), e - b, MADV_SEQUENTIAL);
+}
+
+/*
+ * Copies the finished batches of a fill to consecutive positions from dst, each as an ex.async task,
+ * so that copying one batch overlaps with computing the next. Only one copy is in flight at a time.
+ */
+template<typename T>
+class PipelinedCopy {
+    T *dst_;
+    Executor &ex_;
+    Instrumentation *ins_;
+    std::future<void> sub_;
+    void wait() {
+        if(!sub_.valid()) return;
+        if(ins_) {
+            const auto t = Instrumentation::clock::now();
+            sub_.get();
+            ins_->counters.copy_stall_ns.fetch_add(Instrumentation::ns_since(t), std::memory_order_relaxed);
+        } else sub_.get();
+    }
+public:
+    PipelinedCopy(T *dst, Executor &ex, Instrumentation *ins): dst_(dst), ex_(ex), ins_(ins) {}
+    PipelinedCopy(const PipelinedCopy &) = delete;
+    ~PipelinedCopy() {if(sub_.valid()) sub_.wait();}
+    void push(std::unique_ptr<T[]> &&up, size_t n) {
+        wait();
+        if(ins_) {
+            ins_->counters.pairs_computed.fetch_add(n, std::memory_order_relaxed);
+            ins_->report();
+        }
+        auto buf = std::make_shared<std::unique_ptr<T[]>>(std::move(up));
+        T *const dst = dst_;
+        Instrumentation *const ins = ins_;
+        dst_ += n;
+        sub_ = ex_.async([buf,dst,n,ins]() {
+            if(ins) {
+                const auto t = Instrumentation::clock::now();
+                std::memcpy(dst, buf->get(), sizeof(T) * n);
+                ins->counters.copy_ns.fetch_add(Instrumentation::ns_since(t), std::memory_order_relaxed);
+            } else std::memcpy(dst, buf->get(), sizeof(T) * n);
+        });
+    }
+    void finish() {
+        if(sub_.valid()) sub_.get();
+    }
+};
+} // namespace detail
+
+/* *
+ * parallel_fill computes oracle(j, i) for every i < j < nitems and stores it in dm.
+ * Rows are computed in batches of nperbatch on ex, and each finished batch is copied into dm
+ * as an ex.async task while the next batch is being computed.
+ * If ins is provided, it receives pair counts, per-thread busy/idle time and copy timings.
+*/
 template<typename T, typename Func, size_t defv>
-void parallel_fill(DistanceMatrix<T, defv> &dm, size_t nitems, const Func &oracle, size_t nperbatch=1) {
+void parallel_fill(DistanceMatrix<T, defv> &dm, size_t nitems, const Func &oracle, size_t nperbatch=1, Executor &ex=default_executor(),
+                   Instrumentation *ins=nullptr)
+{
+    if(nitems < 2) return;
     nperbatch = std::max(nperbatch, size_t(1));
-    T *dmp = dm.data();
-    if(int rc = ::madvise(static_cast<void *>(dmp), dm.num_entries() * sizeof(T), MADV_SEQUENTIAL))
-        throw std::system_error(errno, std::system_category(), std::strerror(rc));
-    std::thread sub;
+    T *const dmp = dm.data();
+    detail::advise_sequential(dmp, dm.num_entries() * sizeof(T));
+    if(ins) {
+        ins->prepare_threads(ex.concurrency());
+        ins->counters.pairs_total.fetch_add(dm.row_ptr(nitems) - dmp, std::memory_order_relaxed);
+    }
+    detail::PipelinedCopy<T> copy(dmp, ex, ins);
     if(nperbatch <= 1) {
         for(size_t i = 0; i < nitems - 1; ++i) {
             auto s = dm.row_span(i);
             auto up = std::make_unique<T[]>(s.second);
-    #ifdef _OPENMP
-            #pragma omp parallel for schedule(dynamic)
-    #endif
-            for(size_t idx = 0; idx < s.second; ++idx) {
-                up[idx] = oracle(idx + i + 1, i);
-            }
-            if(sub.joinable()) sub.join();
-            sub = std::thread([up=std::move(up),&dmp,n=s.second]() {
-                std::memcpy(dmp, up.get(), sizeof(T) * n);
-                dmp += n;
+            T *const upp = up.get();
+            detail::RegionTimer(ins, ex.concurrency()).run(ex, s.second, ex.default_grain(s.second), [&](size_t b, size_t e, unsigned) {
+                for(size_t idx = b; idx < e; ++idx)
+                    upp[idx] = oracle(idx + i + 1, i);
             });
+            copy.push(std::move(up), s.second);
         }
     } else {
         const size_t nbatches = (nitems + nperbatch - 1) / nperbatch;
@@ -451,24 +1220,3183 @@ void parallel_fill(DistanceMatrix<T, defv> &dm, size_t nitems, const Func &oracl
             assert(nelem == nsum);
 #endif
             auto up = std::make_unique<T[]>(nelem);
-#ifdef  _OPENMP
-    #pragma omp parallel for schedule(dynamic)
-#endif
-            for(size_t j = first_row; j < end_row; ++j) {
-                auto myptr = &up[dm.row_ptr(j) - fptr];
-                for(size_t k = j + 1; k < nitems; ++k) {
-                    myptr[k - j - 1] = oracle(k, j);
+            T *const upp = up.get();
+            detail::RegionTimer(ins, ex.concurrency()).run(ex, end_row - first_row, 1, [&](size_t b, size_t e, unsigned) {
+                for(size_t j = first_row + b; j < first_row + e; ++j) {
+                    auto myptr = &upp[dm.row_ptr(j) - fptr];
+                    for(size_t k = j + 1; k < nitems; ++k) {
+                        myptr[k - j - 1] = oracle(k, j);
+                    }
                 }
-            }
-            if(sub.joinable()) sub.join();
-            sub = std::thread([up=std::move(up),&dmp,nelem]() {
-                std::memcpy(dmp, up.get(), sizeof(T) * nelem);
-                dmp += nelem;
             });
+            copy.push(std::move(up), nelem);
+        }
+    }
+    copy.finish();
+    if(ins) ins->report(true);
+}
+
+/* *
+ * RectDistanceMatrix holds the distances between two point sets, one row per point of the first
+ * (e.g., queries) and one column per point of the second (e.g., references), row-major.
+ *
+ * Serialized, it is the magic byte of ArithType with more_magic::RECTANGULAR_FLAG set,
+ * the number of rows and of columns as uint64_t, and then the entries, optionally gzip-compressed.
+ * Constructing from a path that does not exist creates a file-backed matrix of the given dimensions;
+ * an existing uncompressed file is memory-mapped, and a compressed one is read into memory.
+*/
+template<typename ArithType=float>
+class RectDistanceMatrix {
+    static constexpr size_t HEADER_SIZE = 1 + 2 * sizeof(uint64_t);
+    ArithType *data_ = nullptr;
+    std::unique_ptr<ArithType[]> dup_;
+    uint64_t nrows_ = 0, ncols_ = 0;
+    std::unique_ptr<mio::mmap_sink> mfbp_;
+    std::string path_;
+
+    void map_file() {
+        mfbp_.reset(new mio::mmap_sink(path_));
+        data_ = reinterpret_cast<ArithType *>(mfbp_->data() + HEADER_SIZE);
+    }
+    std::array<char, HEADER_SIZE> header() const {
+        std::array<char, HEADER_SIZE> ret;
+        ret[0] = magic_number();
+        std::memcpy(&ret[1], &nrows_, sizeof(nrows_));
+        std::memcpy(&ret[1 + sizeof(nrows_)], &ncols_, sizeof(ncols_));
+        return ret;
+    }
+public:
+    static constexpr uint8_t magic_number() {return more_magic::MAGIC_NUMBER<ArithType>::magic_number | more_magic::RECTANGULAR_FLAG;}
+    using value_type = ArithType;
+    using pointer_type = ArithType *;
+    using const_pointer_type = const ArithType *;
+    RectDistanceMatrix() {}
+    RectDistanceMatrix(size_t nrows, size_t ncols): data_(new ArithType[nrows * ncols]), dup_(data_), nrows_(nrows), ncols_(ncols) {}
+    RectDistanceMatrix(const char *path, size_t nrows=0, size_t ncols=0): path_(path) {
+        if(::access(path, F_OK) == -1) {
+            nrows_ = nrows, ncols_ = ncols;
+            std::FILE *ofp = std::fopen(path, "wb");
+            if(!ofp) throw std::runtime_error(std::string("Could not open file at ") + path);
+            const auto h = header();
+            bool ok = std::fwrite(h.data(), 1, h.size(), ofp) == h.size();
+            ok = ok && ::ftruncate(::fileno(ofp), HEADER_SIZE + sizeof(ArithType) * num_entries()) == 0;
+            if(std::fclose(ofp) || !ok) throw std::runtime_error(std::string("Failed to create matrix at ") + path);
+            map_file();
+            return;
+        }
+        std::FILE *fp = std::fopen(path, "rb");
+        if(!fp) throw std::runtime_error(std::string("Could not open file at ") + path);
+        const int fc = std::fgetc(fp);
+        std::fclose(fp);
+        if(fc == magic_number()) {
+            map_file();
+            if(mfbp_->mapped_length() < HEADER_SIZE) throw std::runtime_error(std::string("File is too short for its header: ") + path);
+            std::memcpy(&nrows_, mfbp_->data() + 1, sizeof(nrows_));
+            std::memcpy(&ncols_, mfbp_->data() + 1 + sizeof(nrows_), sizeof(ncols_));
+            if(mfbp_->mapped_length() < HEADER_SIZE + num_entries() * sizeof(ArithType))
+                throw std::runtime_error(std::string("File is too short for its dimensions: ") + path);
+        } else {
+            path_.clear();
+            read(path);
+        }
+        if((nrows || ncols) && (nrows != nrows_ || ncols != ncols_))
+            throw std::runtime_error(std::string("Matrix at ") + path + " has dimensions " + std::to_string(nrows_) + " x " + std::to_string(ncols_));
+    }
+    RectDistanceMatrix(const RectDistanceMatrix &o): RectDistanceMatrix(o.nrows_, o.ncols_) {
+        std::copy(o.data_, o.data_ + num_entries(), data_);
+    }
+    RectDistanceMatrix(RectDistanceMatrix &&o) = default;
+    RectDistanceMatrix &operator=(RectDistanceMatrix &&o) = default;
+    size_t rows() const {return nrows_;}
+    size_t cols() const {return ncols_;}
+    size_t num_entries() const {return nrows_ * ncols_;}
+    bool is_mmapped() const {return bool(mfbp_);}
+    pointer_type       data()       {return data_;}
+    const_pointer_type data() const {return data_;}
+    auto begin() {return data_;}
+    auto end()   {return data_ + num_entries();}
+    auto begin() const {return data_;}
+    auto end()   const {return data_ + num_entries();}
+    INLINE value_type       &operator()(size_t row, size_t column)       {return data_[row * ncols_ + column];}
+    INLINE const value_type &operator()(size_t row, size_t column) const {return data_[row * ncols_ + column];}
+    pointer_type       row_ptr(size_t row)       {return data_ + row * ncols_;}
+    const_pointer_type row_ptr(size_t row) const {return data_ + row * ncols_;}
+    std::pair<pointer_type, size_t>       row_span(size_t row)       {return std::make_pair(row_ptr(row), size_t(ncols_));}
+    std::pair<const_pointer_type, size_t> row_span(size_t row) const {return std::make_pair(row_ptr(row), size_t(ncols_));}
+    bool operator==(const RectDistanceMatrix &o) const {
+        return nrows_ == o.nrows_ && ncols_ == o.ncols_ && std::equal(data_, data_ + num_entries(), o.data_);
+    }
+    // Flushes a file-backed matrix to disk.
+    void sync() {
+        if(!mfbp_) return;
+        std::error_code ec;
+        mfbp_->sync(ec);
+        if(ec) throw std::system_error(ec, "Failed to sync " + path_);
+    }
+    size_t write(const char *path, int compression_level=0, Instrumentation *ins=nullptr) const {
+        std::string fmt = compression_level ? (std::string("wb") + std::to_string(compression_level % 10)): std::string("wT");
+        gzFile fp = gzopen(std::strcmp(path, "-") ? path: "/dev/stdout", fmt.data());
+        if(!fp) throw std::runtime_error(std::string("Could not open file at ") + path);
+        size_t ret = write(fp, ins);
+        gzclose(fp);
+        if(ins) ins->report(true);
+        return ret;
+    }
+    size_t write(gzFile fp, Instrumentation *ins=nullptr) const {
+        const auto h = header();
+        size_t ret = detail::gzwrite_all(fp, h.data(), h.size());
+        ret += detail::gzwrite_all(fp, data_, sizeof(ArithType) * num_entries(), ins);
+        return ret;
+    }
+    void read(const char *path, Instrumentation *ins=nullptr) {
+        if(mfbp_) throw std::runtime_error("Can't read into a file-backed matrix");
+        path = std::strcmp(path, "-") ? path: "/dev/stdin";
+        gzFile fp = gzopen(path, "rb");
+        if(!fp) throw std::runtime_error(std::string("Could not open file at ") + path);
+        const int magic = gzgetc(fp);
+        uint64_t dims[2];
+        if(magic != magic_number() || gzread(fp, dims, sizeof(dims)) != sizeof(dims)) {
+            gzclose(fp);
+            throw std::runtime_error(std::string("Not a rectangular distance matrix of this type: ") + path);
+        }
+        nrows_ = dims[0], ncols_ = dims[1];
+        dup_.reset(new ArithType[num_entries()]);
+        data_ = dup_.get();
+        try {
+            detail::gzread_all(fp, data_, sizeof(ArithType) * num_entries(), ins);
+        } catch(...) {
+            gzclose(fp);
+            throw;
         }
+        gzclose(fp);
+        if(ins) ins->report(true);
+    }
+};
+
+/* *
+ * parallel_fill for RectDistanceMatrix computes oracle(i, j) for every row i and column j, nperbatch rows at a time,
+ * with each batch split evenly over ex and copied into rm while the next batch is computed, as for DistanceMatrix.
+*/
+template<typename T, typename Func>
+void parallel_fill(RectDistanceMatrix<T> &rm, const Func &oracle, size_t nperbatch=1, Executor &ex=default_executor(), Instrumentation *ins=nullptr) {
+    const size_t nrows = rm.rows(), ncols = rm.cols();
+    if(!nrows || !ncols) return;
+    nperbatch = std::max(nperbatch, size_t(1));
+    detail::advise_sequential(rm.data(), rm.num_entries() * sizeof(T));
+    if(ins) {
+        ins->prepare_threads(ex.concurrency());
+        ins->counters.pairs_total.fetch_add(rm.num_entries(), std::memory_order_relaxed);
+    }
+    detail::PipelinedCopy<T> copy(rm.data(), ex, ins);
+    for(size_t first_row = 0; first_row < nrows; first_row += nperbatch) {
+        const size_t nelem = (std::min(first_row + nperbatch, nrows) - first_row) * ncols;
+        auto up = std::make_unique<T[]>(nelem);
+        T *const upp = up.get();
+        detail::RegionTimer(ins, ex.concurrency()).run(ex, nelem, ex.default_grain(nelem), [&](size_t b, size_t e, unsigned) {
+            size_t i = first_row + b / ncols, j = b % ncols;
+            for(size_t idx = b; idx < e; ++idx) {
+                upp[idx] = oracle(i, j);
+                if(++j == ncols) j = 0, ++i;
+            }
+        });
+        copy.push(std::move(up), nelem);
     }
-    sub.join();
+    copy.finish();
+    if(ins) ins->report(true);
+}
+
+/* *
+ * combine builds the matrix of a's n points followed by b's m points from a, b and their n x m cross distances
+ * (cross(i, j) between a's point i and b's point j), in memory or, given path, in a new file-backed matrix.
+ * Output row i < n is a's row i followed by cross's row i; row n + k is b's row k.
+ * Each output row is assembled by whole-row copies, rows are spread over ex, and a file-backed output is written
+ * front to back, so only the pages being filled need to be resident.
+*/
+template<typename T, size_t defv>
+DistanceMatrix<T, defv> combine(const DistanceMatrix<T, defv> &a, const DistanceMatrix<T, defv> &b, const RectDistanceMatrix<T> &cross,
+                                const char *path=nullptr, Executor &ex=default_executor())
+{
+    const size_t n = a.size(), m = b.size(), total = n + m;
+    if(cross.rows() != n || cross.cols() != m)
+        throw std::invalid_argument("combine: cross distances must be " + std::to_string(n) + " x " + std::to_string(m));
+    if(path && ::access(path, F_OK) == 0) throw std::runtime_error(std::string("Refusing to overwrite existing matrix at ") + path);
+    DistanceMatrix<T, defv> ret = path && total > 1 ? DistanceMatrix<T, defv>(path, total, a(0, 0)): DistanceMatrix<T, defv>(total, a(0, 0));
+    detail::advise_sequential(ret.data(), ret.num_entries() * sizeof(T));
+    parallel_for(ex, total, [&](size_t i, unsigned) {
+        T *dst = ret.row_ptr(i);
+        if(i < n) {
+            const auto row = a.row_span(i);
+            dst = std::copy(row.first, row.first + row.second, dst);
+            std::copy(cross.row_ptr(i), cross.row_ptr(i) + m, dst);
+        } else {
+            const auto row = b.row_span(i - n);
+            std::copy(row.first, row.first + row.second, dst);
+        }
+    }, 16);
+    return ret;
+}
+
+namespace detail {
+// The serialized form of every matrix starts with its magic byte and uint64_t dimension.
+inline std::array<char, 1 + sizeof(uint64_t)> serialized_header(uint8_t magic, uint64_t nelem) {
+    std::array<char, 1 + sizeof(uint64_t)> ret;
+    ret[0] = magic;
+    std::memcpy(&ret[1], &nelem, sizeof(nelem));
+    return ret;
+}
+// Opens path for writing, with "-" meaning stdout.
+inline int open_output(const char *path) {
+    if(std::strcmp(path, "-") == 0) return STDOUT_FILENO;
+    const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) throw std::system_error(errno, std::system_category(), std::string("Could not open file at ") + path);
+    return fd;
+}
+
+// Compresses nb bytes into a standalone gzip member. Concatenated members form a valid gzip stream,
+// so blocks can be compressed independently and in parallel and still be read back with gzread.
+inline std::string gzip_member(const void *data, size_t nb, int level) {
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("Failed to initialize deflate");
+    std::string ret(deflateBound(&zs, std::min(nb, IO_CHUNK_SIZE)) + 64, '\0');
+    const char *p = static_cast<const char *>(data);
+    size_t in_off = 0, out_off = 0;
+    int rc;
+    do {
+        const size_t nin = std::min(nb - in_off, IO_CHUNK_SIZE);
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(p + in_off));
+        zs.avail_in = nin;
+        in_off += nin;
+        const int flush = in_off == nb ? Z_FINISH: Z_NO_FLUSH;
+        do {
+            if(ret.size() - out_off < 64) ret.resize(ret.size() * 2);
+            zs.next_out = reinterpret_cast<Bytef *>(&ret[out_off]);
+            zs.avail_out = std::min(ret.size() - out_off, IO_CHUNK_SIZE);
+            const size_t avail = zs.avail_out;
+            rc = deflate(&zs, flush);
+            out_off += avail - zs.avail_out;
+        } while(zs.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+    } while(in_off < nb);
+    deflateEnd(&zs);
+    if(rc != Z_STREAM_END) throw std::runtime_error("Failed to compress block");
+    ret.resize(out_off);
+    return ret;
 }
+} // namespace detail
+
+/* *
+ * AsyncBlockWriter writes blocks of bytes to a file descriptor, in submission order, from a dedicated I/O thread.
+ * If compression_level > 0, each block is compressed into its own gzip member as an ex.async task,
+ * so compression of several blocks proceeds in parallel with each other and with the producer.
+ * At most max_pending blocks are in flight; push() blocks beyond that, bounding memory use.
+ * If compressing or writing a block fails, nothing after it is written: queued blocks are dropped,
+ * and the error is rethrown by the next push() or by finish().
+ * The descriptor is not closed.
+*/
+class AsyncBlockWriter {
+    struct Block {
+        std::shared_ptr<const void> data;
+        size_t size;
+        std::shared_ptr<std::string> compressed;
+        std::future<void> ready;
+    };
+    const int fd_, level_;
+    Executor &ex_;
+    Instrumentation *ins_;
+    const size_t max_pending_;
+    std::deque<Block> queue_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool done_ = false;
+    std::exception_ptr exc_;
+    size_t nwritten_ = 0;
+    std::thread writer_;
+    void work() {
+        for(;;) {
+            Block block;
+            {
+                std::unique_lock<std::mutex> lock(m_);
+                cv_.wait(lock, [this]() {return done_ || !queue_.empty();});
+                if(queue_.empty()) return;
+                block = std::move(queue_.front());
+            }
+            try {
+                block.ready.get();
+                if(block.compressed) nwritten_ += detail::write_all(fd_, block.compressed->data(), block.compressed->size(), ins_);
+                else                 nwritten_ += detail::write_all(fd_, block.data.get(), block.size, ins_);
+            } catch(...) {
+                {
+                    // Writing later blocks would leave a gap in the stream: drop them and wake blocked producers.
+                    std::lock_guard<std::mutex> lock(m_);
+                    if(!exc_) exc_ = std::current_exception();
+                    queue_.clear();
+                }
+                cv_.notify_all();
+                continue;
+            }
+            {
+                // Pop only once written, so that the queue length bounds memory use.
+                std::lock_guard<std::mutex> lock(m_);
+                queue_.pop_front();
+            }
+            cv_.notify_all();
+        }
+    }
+public:
+    AsyncBlockWriter(int fd, int compression_level=0, Executor &ex=default_executor(), size_t max_pending=4, Instrumentation *ins=nullptr):
+        fd_(fd), level_(compression_level), ex_(ex), ins_(ins), max_pending_(std::max(max_pending, size_t(1)))
+    {
+        writer_ = std::thread([this]() {work();});
+    }
+    AsyncBlockWriter(const AsyncBlockWriter &) = delete;
+    ~AsyncBlockWriter() {
+        try {finish();} catch(...) {}
+    }
+    int compression_level() const {return level_;}
+    // Queues data[0, nb) for writing; data is kept alive until it has been written.
+    void push(std::shared_ptr<const void> data, size_t nb) {
+        Block block;
+        if(level_ > 0) {
+            auto out = std::make_shared<std::string>();
+            const int level = level_;
+            const void *p = data.get();
+            block.compressed = out;
+            block.ready = ex_.async([out,p,nb,level,data]() {*out = detail::gzip_member(p, nb, level);});
+            block.data = std::move(data);
+        } else {
+            std::promise<void> pr;
+            pr.set_value();
+            block.ready = pr.get_future();
+            block.data = std::move(data);
+        }
+        block.size = nb;
+        if(ins_) ins_->counters.bytes_uncompressed.fetch_add(nb, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(m_);
+        if(exc_) std::rethrow_exception(exc_);
+        if(queue_.size() >= max_pending_) {
+            auto wait = [&]() {cv_.wait(lock, [this]() {return queue_.size() < max_pending_ || exc_;});};
+            if(ins_) {
+                const auto t = Instrumentation::clock::now();
+                wait();
+                ins_->counters.copy_stall_ns.fetch_add(Instrumentation::ns_since(t), std::memory_order_relaxed);
+            } else wait();
+            if(exc_) std::rethrow_exception(exc_);
+        }
+        queue_.emplace_back(std::move(block));
+        lock.unlock();
+        cv_.notify_all();
+    }
+    void push(const void *data, size_t nb) {
+        auto buf = std::shared_ptr<char>(new char[nb], std::default_delete<char[]>());
+        std::memcpy(buf.get(), data, nb);
+        push(std::shared_ptr<const void>(std::move(buf)), nb);
+    }
+    // Waits for all queued blocks to be written; returns the number of bytes written to the descriptor.
+    size_t finish() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            done_ = true;
+        }
+        cv_.notify_all();
+        if(writer_.joinable()) writer_.join();
+        if(exc_) {
+            auto e = exc_;
+            exc_ = nullptr;
+            std::rethrow_exception(e);
+        }
+        return nwritten_;
+    }
+};
+
+/* *
+ * stream_fill computes the same values as parallel_fill, but streams them to fd in the serialized
+ * DistanceMatrix format instead of storing them, so the full matrix never has to be resident.
+ * Each batch of nperbatch rows is computed on ex, then handed to an AsyncBlockWriter
+ * (optionally gzip-compressing it), while the next batch is computed.
+ * Peak memory is about (max_pending + 1) batches. The output can be read with DistanceMatrix::read.
+ * Returns the number of bytes written.
+*/
+template<typename T, typename Func>
+size_t stream_fill(int fd, size_t nitems, const Func &oracle, size_t nperbatch=64, int compression_level=0,
+                   Executor &ex=default_executor(), Instrumentation *ins=nullptr, size_t max_pending=2)
+{
+    nperbatch = std::max(nperbatch, size_t(1));
+    AsyncBlockWriter writer(fd, compression_level, ex, max_pending, ins);
+    {
+        const auto header = detail::serialized_header(more_magic::MAGIC_NUMBER<T>::magic_number, nitems);
+        writer.push(header.data(), header.size());
+    }
+    if(ins) {
+        ins->prepare_threads(ex.concurrency());
+        ins->counters.pairs_total.fetch_add(nitems * (nitems - !!nitems) / 2, std::memory_order_relaxed);
+    }
+    // Offset of row i within a buffer starting at row first.
+    auto offset = [nitems](size_t first, size_t i) {
+        return (i - first) * nitems - (i * (i + 1) / 2 - first * (first + 1) / 2);
+    };
+    for(size_t first_row = 0; first_row + 1 < nitems; first_row += nperbatch) {
+        const size_t end_row = std::min(first_row + nperbatch, nitems);
+        const size_t nelem = offset(first_row, end_row);
+        std::shared_ptr<T> buf(new T[nelem], std::default_delete<T[]>());
+        T *const bufp = buf.get();
+        detail::RegionTimer(ins, ex.concurrency()).run(ex, end_row - first_row, 1, [&](size_t b, size_t e, unsigned) {
+            for(size_t j = first_row + b; j < first_row + e; ++j) {
+                T *myptr = bufp + offset(first_row, j);
+                for(size_t k = j + 1; k < nitems; ++k)
+                    myptr[k - j - 1] = oracle(k, j);
+            }
+        });
+        if(ins) {
+            ins->counters.pairs_computed.fetch_add(nelem, std::memory_order_relaxed);
+            ins->report();
+        }
+        writer.push(std::shared_ptr<const void>(std::move(buf)), nelem * sizeof(T));
+    }
+    const size_t ret = writer.finish();
+    if(ins) ins->report(true);
+    return ret;
+}
+
+template<typename T, typename Func>
+size_t stream_fill(std::FILE *fp, size_t nitems, const Func &oracle, size_t nperbatch=64, int compression_level=0,
+                   Executor &ex=default_executor(), Instrumentation *ins=nullptr, size_t max_pending=2)
+{
+    std::fflush(fp);
+    return stream_fill<T>(::fileno(fp), nitems, oracle, nperbatch, compression_level, ex, ins, max_pending);
+}
+
+template<typename T, typename Func>
+size_t stream_fill(const char *path, size_t nitems, const Func &oracle, size_t nperbatch=64, int compression_level=0,
+                   Executor &ex=default_executor(), Instrumentation *ins=nullptr, size_t max_pending=2)
+{
+    const bool use_stdout = std::strcmp(path, "-") == 0;
+    const int fd = detail::open_output(path);
+    size_t ret;
+    try {
+        ret = stream_fill<T>(fd, nitems, oracle, nperbatch, compression_level, ex, ins, max_pending);
+    } catch(...) {
+        if(!use_stdout) ::close(fd);
+        throw;
+    }
+    if(!use_stdout) ::close(fd);
+    return ret;
+}
+
+/* *
+ * DistanceMatrixWriter serializes a DistanceMatrix<ArithType> row by row, without holding the matrix.
+ * Row i holds the nelem - i - 1 distances (i, j) for j > i, as given by DistanceMatrix::row_span.
+ * Rows may be appended from several threads and out of order: up to max_reorder rows ahead of the
+ * next missing row are buffered, and append_row blocks for rows further ahead, until earlier rows arrive.
+ * A row that would block while every other producer is already blocked can never be written, so append_row
+ * throws std::out_of_range for it (and for the rows the other producers are waiting on) instead.
+ * The writer assumes a single producer, for which any row max_reorder or more ahead throws at once;
+ * call set_producers(n) before appending from n threads.
+ * Output goes through an AsyncBlockWriter in blocks of about block_bytes, compressed on the executor
+ * if compression_level > 0, and is byte-compatible with what DistanceMatrix::read expects.
+*/
+template<typename ArithType=float>
+class DistanceMatrixWriter {
+    const uint64_t nelem_;
+    int fd_;
+    bool owns_fd_;
+    const size_t max_reorder_, block_bytes_;
+    Instrumentation *ins_;
+    std::unique_ptr<AsyncBlockWriter> writer_;
+    std::map<size_t, std::unique_ptr<ArithType[]>> pending_;
+    std::shared_ptr<char> block_;
+    size_t block_used_ = 0;
+    size_t next_row_ = 0;
+    size_t nwritten_ = 0;
+    size_t nproducers_ = 1, nstalls_ = 0;
+    std::multiset<size_t> waiting_; // Rows of producers blocked in append_row
+    bool finished_ = false;
+    std::mutex m_;
+    std::condition_variable cv_;
+
+    void init(int compression_level, Executor &ex) {
+        writer_.reset(new AsyncBlockWriter(fd_, compression_level, ex, std::max(size_t(2), size_t(ex.concurrency()) * 2), ins_));
+        const auto header = detail::serialized_header(magic_number(), nelem_);
+        writer_->push(header.data(), header.size());
+    }
+    void flush_block() {
+        if(!block_used_) return;
+        writer_->push(std::shared_ptr<const void>(std::move(block_)), block_used_);
+        block_used_ = 0;
+    }
+    void emit(const ArithType *data, size_t n) {
+        const size_t nb = n * sizeof(ArithType);
+        if(ins_) ins_->counters.pairs_computed.fetch_add(n, std::memory_order_relaxed);
+        if(nb >= block_bytes_) {
+            flush_block();
+            writer_->push(data, nb);
+            return;
+        }
+        if(block_used_ + nb > block_bytes_) flush_block();
+        if(!block_) block_.reset(new char[block_bytes_], std::default_delete<char[]>());
+        std::memcpy(block_.get() + block_used_, data, nb);
+        block_used_ += nb;
+    }
+public:
+    static constexpr more_magic::MagicNumber magic_number() {return more_magic::MAGIC_NUMBER<ArithType>::magic_number;}
+    using value_type = ArithType;
+    DistanceMatrixWriter(int fd, uint64_t nelem, int compression_level=0, size_t max_reorder=1024,
+                         Executor &ex=default_executor(), Instrumentation *ins=nullptr, size_t block_bytes=size_t(1) << 22):
+        nelem_(nelem), fd_(fd), owns_fd_(false), max_reorder_(std::max(max_reorder, size_t(1))), block_bytes_(block_bytes), ins_(ins)
+    {
+        init(compression_level, ex);
+    }
+    DistanceMatrixWriter(const char *path, uint64_t nelem, int compression_level=0, size_t max_reorder=1024,
+                         Executor &ex=default_executor(), Instrumentation *ins=nullptr, size_t block_bytes=size_t(1) << 22):
+        nelem_(nelem), fd_(detail::open_output(path)), owns_fd_(fd_ != STDOUT_FILENO), max_reorder_(std::max(max_reorder, size_t(1))), block_bytes_(block_bytes), ins_(ins)
+    {
+        init(compression_level, ex);
+    }
+    DistanceMatrixWriter(std::FILE *fp, uint64_t nelem, int compression_level=0, size_t max_reorder=1024,
+                         Executor &ex=default_executor(), Instrumentation *ins=nullptr, size_t block_bytes=size_t(1) << 22):
+        DistanceMatrixWriter((std::fflush(fp), ::fileno(fp)), nelem, compression_level, max_reorder, ex, ins, block_bytes) {}
+    DistanceMatrixWriter(const DistanceMatrixWriter &) = delete;
+    ~DistanceMatrixWriter() {
+        if(!finished_) {
+            try {
+                writer_->finish();
+            } catch(...) {}
+            if(owns_fd_) ::close(fd_);
+        }
+    }
+    uint64_t nelem() const {return nelem_;}
+    size_t row_length(size_t i) const {return nelem_ - i - 1;}
+    // Number of threads that will call append_row; see the class comment.
+    void set_producers(size_t nproducers) {
+        std::lock_guard<std::mutex> lock(m_);
+        nproducers_ = std::max(nproducers, size_t(1));
+    }
+    // Rows before next_row() have been handed to the output.
+    size_t next_row() {
+        std::lock_guard<std::mutex> lock(m_);
+        return next_row_;
+    }
+    void append_row(size_t i, const ArithType *data, size_t n) {
+        if(i >= nelem_ || n != row_length(i))
+            throw std::invalid_argument(std::string("Row ") + std::to_string(i) + " should have " + std::to_string(i < nelem_ ? row_length(i): size_t(0)) + " entries, not " + std::to_string(n));
+        std::unique_lock<std::mutex> lock(m_);
+        if(finished_) throw std::runtime_error("append_row called after finish");
+        auto check_duplicate = [&]() {
+            if(i < next_row_ || pending_.find(i) != pending_.end())
+                throw std::invalid_argument(std::string("Row ") + std::to_string(i) + " appended twice");
+        };
+        check_duplicate();
+        if(i >= next_row_ + max_reorder_) {
+            auto stalled = [&]() {
+                return std::out_of_range(std::string("Row ") + std::to_string(i) + " is too far ahead of missing row "
+                                         + std::to_string(next_row_) + " to ever be written");
+            };
+            // Waiters woken by progress but not yet running are not stuck, so count only rows still out of the window.
+            const size_t nstuck = std::distance(waiting_.lower_bound(next_row_ + max_reorder_), waiting_.end());
+            if(nstuck + 1 >= nproducers_) {
+                // Every producer would be waiting for rows none of them will append: fail them all.
+                ++nstalls_;
+                cv_.notify_all();
+                throw stalled();
+            }
+            const size_t stalls = nstalls_;
+            const auto it = waiting_.insert(i);
+            cv_.wait(lock, [&]() {return i < next_row_ + max_reorder_ || nstalls_ != stalls;});
+            waiting_.erase(it);
+            if(i >= next_row_ + max_reorder_) throw stalled();
+            // Another thread may have appended the same row while we waited.
+            check_duplicate();
+        }
+        if(i != next_row_) {
+            std::unique_ptr<ArithType[]> copy(new ArithType[n]);
+            std::copy(data, data + n, copy.get());
+            pending_.emplace(i, std::move(copy));
+            return;
+        }
+        emit(data, n);
+        ++next_row_;
+        for(auto it = pending_.begin(); it != pending_.end() && it->first == next_row_; it = pending_.erase(it)) {
+            emit(it->second.get(), row_length(next_row_));
+            ++next_row_;
+        }
+        if(ins_) ins_->report();
+        lock.unlock();
+        cv_.notify_all();
+    }
+    void append_row(size_t i, std::pair<const ArithType *, size_t> span) {append_row(i, span.first, span.second);}
+    void append_row(const ArithType *data, size_t n) {append_row(next_row(), data, n);}
+    // Appends rows [first_row, end_row) stored contiguously, as in DistanceMatrix::row_ptr(first_row).
+    void append_rows(size_t first_row, size_t end_row, const ArithType *data) {
+        for(size_t i = first_row; i < end_row; data += row_length(i++))
+            append_row(i, data, row_length(i));
+    }
+    // Flushes all rows and closes the output if we opened it; returns the number of bytes written.
+    size_t finish() {
+        std::lock_guard<std::mutex> lock(m_);
+        if(finished_) return nwritten_;
+        // The last row is empty, so it need not be appended.
+        if(next_row_ + 1 < nelem_)
+            throw std::runtime_error(std::string("Only ") + std::to_string(next_row_) + " of " + std::to_string(nelem_) + " rows were appended");
+        finished_ = true;
+        flush_block();
+        try {
+            nwritten_ = writer_->finish();
+        } catch(...) {
+            if(owns_fd_) ::close(fd_);
+            throw;
+        }
+        if(owns_fd_ && ::close(fd_))
+            throw std::system_error(errno, std::system_category(), "Failed to close output");
+        if(ins_) ins_->report(true);
+        return nwritten_;
+    }
+};
+
+/* *
+ * DistanceMatrixReader walks a serialized DistanceMatrix<ArithType> (compressed or not, "-" for stdin)
+ * in batches of consecutive rows, without loading the whole matrix.
+ * A read-ahead thread reads and decompresses up to read_ahead batches of about batch_bytes each,
+ * so decompression overlaps with whatever the caller does with the current batch.
+ *
+ * Use next(batch) to get row batches, or next_row(i, span) to get one row at a time;
+ * spans are laid out as in DistanceMatrix::row_span.
+*/
+template<typename ArithType=float>
+class DistanceMatrixReader {
+public:
+    using value_type = ArithType;
+    class RowBatch {
+        size_t first_row_ = 0, end_row_ = 0;
+        uint64_t nelem_ = 0;
+        std::unique_ptr<ArithType[]> data_;
+        friend class DistanceMatrixReader;
+    public:
+        size_t first_row() const {return first_row_;}
+        size_t end_row() const {return end_row_;}
+        size_t nrows() const {return end_row_ - first_row_;}
+        size_t num_entries() const {return offset(end_row_);}
+        const ArithType *data() const {return data_.get();}
+        // Offset of global row i within this batch.
+        size_t offset(size_t i) const {
+            return (i - first_row_) * nelem_ - (i * (i + 1) / 2 - first_row_ * (first_row_ + 1) / 2);
+        }
+        std::pair<const ArithType *, size_t> row_span(size_t i) const {
+            assert(i >= first_row_ && i < end_row_);
+            return std::make_pair(data_.get() + offset(i), size_t(nelem_ - i - 1));
+        }
+    };
+private:
+    gzFile fp_;
+    uint64_t nelem_;
+    const size_t batch_bytes_, read_ahead_;
+    Instrumentation *ins_;
+    std::deque<RowBatch> queue_;
+    bool eof_ = false, stop_ = false;
+    std::exception_ptr exc_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::thread thread_;
+    RowBatch current_;
+    size_t current_row_ = 0;
+
+    void work() {
+        try {
+            for(size_t first = 0; first < nelem_;) {
+                RowBatch batch;
+                batch.nelem_ = nelem_;
+                batch.first_row_ = first;
+                size_t end = first, nb = 0;
+                do {
+                    nb += (nelem_ - end - 1) * sizeof(ArithType);
+                    ++end;
+                } while(end < nelem_ && nb < batch_bytes_);
+                batch.end_row_ = end;
+                batch.data_.reset(new ArithType[nb / sizeof(ArithType)]);
+                detail::gzread_all(fp_, batch.data_.get(), nb, ins_);
+                if(ins_) ins_->counters.pairs_computed.fetch_add(nb / sizeof(ArithType), std::memory_order_relaxed);
+                first = end;
+                std::unique_lock<std::mutex> lock(m_);
+                cv_.wait(lock, [this]() {return stop_ || queue_.size() < read_ahead_;});
+                if(stop_) return;
+                queue_.emplace_back(std::move(batch));
+                cv_.notify_all();
+            }
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(m_);
+            exc_ = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(m_);
+        eof_ = true;
+        cv_.notify_all();
+    }
+public:
+    DistanceMatrixReader(const char *path, size_t batch_bytes=size_t(1) << 24, size_t read_ahead=2, Instrumentation *ins=nullptr):
+        batch_bytes_(batch_bytes), read_ahead_(std::max(read_ahead, size_t(1))), ins_(ins)
+    {
+        path = std::strcmp(path, "-") ? path: "/dev/stdin";
+        if((fp_ = gzopen(path, "rb")) == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+        gzbuffer(fp_, 1 << 18);
+        const int magic = gzgetc(fp_);
+        if(magic != more_magic::MAGIC_NUMBER<ArithType>::magic_number) {
+            gzclose(fp_);
+            char buf[256];
+            std::snprintf(buf, sizeof(buf), "Wrong magic number read from file (%d/%s), expected (%d/%s)\n", magic, more_magic::magic_name(magic),
+                          int(more_magic::MAGIC_NUMBER<ArithType>::magic_number), more_magic::MAGIC_NUMBER<ArithType>::name());
+            throw std::runtime_error(buf);
+        }
+        if(gzread(fp_, &nelem_, sizeof(nelem_)) != sizeof(nelem_)) {
+            gzclose(fp_);
+            throw std::runtime_error(std::string("Could not read nelem from ") + path);
+        }
+        if(ins_) ins_->counters.pairs_total.fetch_add(nelem_ * (nelem_ - !!nelem_) / 2, std::memory_order_relaxed);
+        thread_ = std::thread([this]() {work();});
+    }
+    DistanceMatrixReader(const DistanceMatrixReader &) = delete;
+    ~DistanceMatrixReader() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+        gzclose(fp_);
+    }
+    uint64_t nelem() const {return nelem_;}
+    size_t size() const {return nelem_;}
+    size_t num_entries() const {return nelem_ * (nelem_ - !!nelem_) / 2;}
+    // Moves the next batch into batch; returns false once all rows have been returned.
+    bool next(RowBatch &batch) {
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [this]() {return eof_ || !queue_.empty();});
+        if(queue_.empty()) {
+            if(exc_) std::rethrow_exception(exc_);
+            return false;
+        }
+        batch = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+        cv_.notify_all();
+        return true;
+    }
+    // Sets i and span to the next row; returns false at the end. span stays valid until the batch is exhausted.
+    bool next_row(size_t &i, std::pair<const ArithType *, size_t> &span) {
+        if(current_row_ >= current_.end_row_) {
+            if(!next(current_)) return false;
+            current_row_ = current_.first_row_;
+        }
+        i = current_row_++;
+        span = current_.row_span(i);
+        return true;
+    }
+    // Calls func(batch) for every remaining batch.
+    template<typename Func>
+    void for_each_batch(const Func &func) {
+        RowBatch batch;
+        while(next(batch)) func(static_cast<const RowBatch &>(batch));
+    }
+};
+
+namespace detail {
+template<typename T> struct type_tag {using type = T;};
+
+// Calls func(type_tag<T>()) for the element type T that magic names.
+template<typename Func>
+auto dispatch_magic(int magic, const Func &func) -> decltype(func(type_tag<float>())) {
+    switch(magic) {
+        case more_magic::FLOAT:     return func(type_tag<float>());
+        case more_magic::DOUBLE:    return func(type_tag<double>());
+        case more_magic::UINT8_T:   return func(type_tag<uint8_t>());
+        case more_magic::UINT16_T:  return func(type_tag<uint16_t>());
+        case more_magic::UINT32_T:  return func(type_tag<uint32_t>());
+        case more_magic::UINT64_T:  return func(type_tag<uint64_t>());
+        case more_magic::UINT128_T: return func(type_tag<__uint128_t>());
+        case more_magic::INT8_T:    return func(type_tag<int8_t>());
+        case more_magic::INT16_T:   return func(type_tag<int16_t>());
+        case more_magic::INT32_T:   return func(type_tag<int32_t>());
+        case more_magic::INT64_T:   return func(type_tag<int64_t>());
+        case more_magic::INT128_T:  return func(type_tag<__int128_t>());
+    }
+    throw std::invalid_argument(std::string("Unsupported magic number ") + std::to_string(magic) + " (" + more_magic::magic_name(magic) + ")");
+}
+
+// The magic byte of the serialized matrix at path.
+inline int read_magic(const char *path) {
+    gzFile fp = gzopen(path, "rb");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+    const int magic = gzgetc(fp);
+    gzclose(fp);
+    if(magic < 0) throw std::runtime_error(std::string("Could not read magic number from ") + path);
+    return magic;
+}
+
+template<typename In, typename Out>
+size_t convert_file_impl(const char *inpath, const char *outpath, double scale, int compression_level, Executor &ex, size_t batch_bytes) {
+    DistanceMatrixReader<In> reader(inpath, batch_bytes);
+    DistanceMatrixWriter<Out> writer(outpath, reader.size(), compression_level, 1024, ex);
+    typename DistanceMatrixReader<In>::RowBatch batch;
+    std::vector<Out> buf;
+    while(reader.next(batch)) {
+        const size_t m = batch.num_entries();
+        buf.resize(m);
+        const In *const src = batch.data();
+        Out *const dst = buf.data();
+        ex.for_each_range(m, std::max(size_t(1) << 16, ex.default_grain(m)), [&](size_t b, size_t e, unsigned) {
+            for(size_t i = b; i < e; ++i) dst[i] = saturating_cast<Out>(src[i], scale);
+        });
+        writer.append_rows(batch.first_row(), batch.end_row(), dst);
+    }
+    return writer.finish();
+}
+} // namespace detail
+
+/* *
+ * convert_file rewrites the serialized matrix at inpath (of any element type, compressed or not) as Out at outpath,
+ * with the same rounding and saturation as DistanceMatrix::convert. It streams batches of about batch_bytes through
+ * a DistanceMatrixReader and a DistanceMatrixWriter, so memory stays O(batch_bytes) whatever the matrix size.
+ * The second overload takes the output type at run time. Returns the number of bytes written.
+*/
+template<typename Out>
+size_t convert_file(const char *inpath, const char *outpath, double scale=1., int compression_level=0,
+                    Executor &ex=default_executor(), size_t batch_bytes=size_t(1) << 24)
+{
+    if(std::strcmp(inpath, "-") == 0) throw std::invalid_argument("convert_file needs the input type, so it cannot read stdin");
+    return detail::dispatch_magic(detail::read_magic(inpath), [&](auto in) {
+        return detail::convert_file_impl<typename decltype(in)::type, Out>(inpath, outpath, scale, compression_level, ex, batch_bytes);
+    });
+}
+inline size_t convert_file(const char *inpath, const char *outpath, more_magic::MagicNumber out_type, double scale=1., int compression_level=0,
+                           Executor &ex=default_executor(), size_t batch_bytes=size_t(1) << 24)
+{
+    return detail::dispatch_magic(out_type, [&](auto out) {
+        return convert_file<typename decltype(out)::type>(inpath, outpath, scale, compression_level, ex, batch_bytes);
+    });
+}
+
+namespace detail {
+// Column holding entry idx of a column-major triangle, i.e. the largest k with k * (k - 1) / 2 <= idx.
+inline size_t triangle_column(size_t idx) {
+    size_t k = (1. + std::sqrt(1. + 8. * double(idx))) / 2.;
+    while(k * (k - 1) / 2 > idx) --k;
+    while((k + 1) * k / 2 <= idx) ++k;
+    return k;
+}
+
+/*
+ * Converts between the row-major (DistanceMatrix) and column-major (GrowableDistanceMatrix) upper triangles.
+ * Rows are processed in tiles, so the part of each column belonging to a tile is one contiguous run.
+ */
+template<typename T>
+void transpose_triangle(const T *src, T *dst, size_t n, bool row_major_src, Executor &ex) {
+    static constexpr size_t TILE = 64;
+    auto rowidx = [n](size_t i, size_t j) {return i * (2 * n - i - 1) / 2 + j - i - 1;};
+    auto colidx = [](size_t i, size_t j) {return j * (j - 1) / 2 + i;};
+    ex.for_each_range((n + TILE - 1) / TILE, 1, [&](size_t b, size_t e, unsigned) {
+        for(size_t tile = b; tile < e; ++tile) {
+            const size_t r0 = tile * TILE, r1 = std::min(r0 + TILE, n);
+            for(size_t j = r0 + 1; j < n; ++j) {
+                const size_t iend = std::min(r1, j);
+                for(size_t i = r0; i < iend; ++i) {
+                    if(row_major_src) dst[colidx(i, j)] = src[rowidx(i, j)];
+                    else              dst[rowidx(i, j)] = src[colidx(i, j)];
+                }
+            }
+        }
+    });
+}
+} // namespace detail
+
+/* *
+ * GrowableDistanceMatrix holds the same upper triangle as DistanceMatrix, but column by column:
+ * column j holds the distances (i, j) for i < j, so appending points only appends columns.
+ * append(m, oracle) computes just the N * m + m * (m - 1) / 2 new pairs and never moves existing data.
+ *
+ * When backed by a file, the file is the serialized form (magic byte with COLUMN_MAJOR_FLAG set, nelem,
+ * then the columns). Appending extends it with ftruncate and remaps it, so old distances are never copied,
+ * and the header is only updated once the new columns have been computed.
+ * In memory, storage grows geometrically like a std::vector.
+*/
+template<typename ArithType=float,
+         size_t DefaultValue=0>
+class GrowableDistanceMatrix {
+    ArithType *data_ = nullptr;
+    std::unique_ptr<ArithType[]> dup_;
+    uint64_t nelem_ = 0;
+    size_t capacity_ = 0; // in entries, for in-memory storage
+    ArithType default_value_;
+    std::unique_ptr<mio::mmap_sink> mfbp_;
+    std::string path_;
+    static constexpr size_t HEADER_SIZE = 1 + sizeof(uint64_t);
+
+    void map_file() {
+        mfbp_.reset(new mio::mmap_sink(path_));
+        data_ = reinterpret_cast<ArithType *>(mfbp_->data() + HEADER_SIZE);
+    }
+    // Makes room for new_size points; the new entries are uninitialized.
+    void reserve_points(size_t new_size) {
+        const size_t nentries = num_entries_for(new_size);
+        if(mfbp_) {
+            mfbp_.reset();
+            if(::truncate(path_.data(), HEADER_SIZE + nentries * sizeof(ArithType)))
+                throw std::system_error(errno, std::system_category(), std::string("Failed to extend ") + path_);
+            map_file();
+        } else if(nentries > capacity_) {
+            const size_t ncap = std::max(nentries, capacity_ + capacity_ / 2);
+            std::unique_ptr<ArithType[]> nd(new ArithType[ncap]);
+            std::copy(data_, data_ + num_entries(), nd.get());
+            dup_ = std::move(nd);
+            data_ = dup_.get();
+            capacity_ = ncap;
+        }
+    }
+    void set_nelem(uint64_t n) {
+        nelem_ = n;
+        if(mfbp_) std::memcpy(mfbp_->data() + 1, &nelem_, sizeof(nelem_));
+    }
+public:
+    static constexpr uint8_t magic_number() {return more_magic::MAGIC_NUMBER<ArithType>::magic_number | more_magic::COLUMN_MAJOR_FLAG;}
+    using value_type = ArithType;
+    using pointer_type = ArithType *;
+    using const_pointer_type = const ArithType *;
+    static constexpr ArithType DEFAULT_VALUE = static_cast<ArithType>(DefaultValue);
+    static constexpr size_t num_entries_for(size_t n) {return n * (n - !!n) / 2;}
+
+    GrowableDistanceMatrix(size_t n=0, ArithType default_value=DEFAULT_VALUE): default_value_(default_value) {
+        reserve_points(n);
+        nelem_ = n;
+    }
+    /*
+     * Opens path, memory-mapping it if it is an uncompressed growable matrix;
+     * a compressed file is loaded into memory instead.
+     * If path does not exist, an empty file-backed matrix is created there.
+     */
+    GrowableDistanceMatrix(const char *path, ArithType default_value=DEFAULT_VALUE): default_value_(default_value), path_(path) {
+        if(::access(path, F_OK) == -1) {
+            std::FILE *ofp = std::fopen(path, "wb");
+            if(!ofp) throw std::runtime_error(std::string("Could not open file at ") + path);
+            const auto header = detail::serialized_header(magic_number(), 0);
+            const bool ok = std::fwrite(header.data(), 1, header.size(), ofp) == header.size();
+            if(std::fclose(ofp) || !ok) throw std::runtime_error(std::string("Failed to write header to ") + path);
+            map_file();
+            return;
+        }
+        std::FILE *fp = std::fopen(path, "rb");
+        if(!fp) throw std::runtime_error(std::string("Could not open file at ") + path);
+        const int fc = std::fgetc(fp);
+        std::fclose(fp);
+        if(fc == magic_number()) {
+            map_file();
+            std::memcpy(&nelem_, mfbp_->data() + 1, sizeof(nelem_));
+            if(mfbp_->mapped_length() < HEADER_SIZE + num_entries() * sizeof(ArithType))
+                throw std::runtime_error(std::string("File is too short for its dimension: ") + path);
+        } else {
+            path_.clear();
+            read(path);
+        }
+    }
+    // Copies a row-major DistanceMatrix, into memory or into a new file at path.
+    explicit GrowableDistanceMatrix(const DistanceMatrix<ArithType, DefaultValue> &o, const char *path=nullptr, Executor &ex=default_executor()):
+        default_value_(o(0, 0))
+    {
+        if(path) {
+            *this = GrowableDistanceMatrix(path, default_value_);
+            if(nelem_) throw std::runtime_error(std::string("Refusing to overwrite existing matrix at ") + path);
+        }
+        reserve_points(o.size());
+        set_nelem(o.size());
+        detail::transpose_triangle(o.data(), data_, nelem_, true, ex);
+    }
+    GrowableDistanceMatrix(GrowableDistanceMatrix &&o) = default;
+    GrowableDistanceMatrix &operator=(GrowableDistanceMatrix &&o) = default;
+
+    void set_default_value(ArithType val) {default_value_ = val;}
+    size_t size() const {return nelem_;}
+    size_t nelem() const {return nelem_;}
+    size_t rows() const {return nelem_;}
+    size_t columns() const {return nelem_;}
+    size_t num_entries() const {return num_entries_for(nelem_);}
+    bool is_mmapped() const {return bool(mfbp_);}
+    pointer_type       data()       {return data_;}
+    const_pointer_type data() const {return data_;}
+    auto begin() {return data_;}
+    auto end()   {return data_ + num_entries();}
+    auto begin() const {return data_;}
+    auto end()   const {return data_ + num_entries();}
+    INLINE size_t index(size_t row, size_t column) const {
+        return row < column ? num_entries_for(column) + row: num_entries_for(row) + column;
+    }
+    INLINE value_type &operator()(size_t row, size_t column) {
+        if(__builtin_expect(row == column, 0)) return default_value_;
+        return data_[index(row, column)];
+    }
+    INLINE const value_type &operator()(size_t row, size_t column) const {
+        if(__builtin_expect(row == column, 0)) return default_value_;
+        return data_[index(row, column)];
+    }
+    pointer_type       column_ptr(size_t j)       {return data_ + num_entries_for(j);}
+    const_pointer_type column_ptr(size_t j) const {return data_ + num_entries_for(j);}
+    std::pair<pointer_type, size_t>       column_span(size_t j)       {return std::make_pair(column_ptr(j), j);}
+    std::pair<const_pointer_type, size_t> column_span(size_t j) const {return std::make_pair(column_ptr(j), j);}
+
+    /* *
+     * Adds m points, computing oracle(k, i) for each new point k and every i < k,
+     * the same convention as parallel_fill. Work is split evenly over ex, even when m == 1.
+    */
+    template<typename Func>
+    void append(size_t m, const Func &oracle, Executor &ex=default_executor(), Instrumentation *ins=nullptr) {
+        if(!m) return;
+        const size_t old_n = nelem_, new_n = nelem_ + m;
+        const size_t first = num_entries_for(old_n), last = num_entries_for(new_n);
+        reserve_points(new_n);
+        ArithType *const dp = data_;
+        if(ins) {
+            ins->prepare_threads(ex.concurrency());
+            ins->counters.pairs_total.fetch_add(last - first, std::memory_order_relaxed);
+        }
+        detail::RegionTimer(ins, ex.concurrency()).run(ex, last - first, std::max(size_t(4096), ex.default_grain(last - first)), [&](size_t b, size_t e, unsigned) {
+            // Find the column holding entry first + b, then walk forward.
+            size_t k = detail::triangle_column(first + b), i = first + b - num_entries_for(k);
+            for(size_t idx = first + b; idx < first + e; ++idx) {
+                dp[idx] = oracle(k, i);
+                if(++i == k) ++k, i = 0;
+            }
+            if(ins) {
+                ins->counters.pairs_computed.fetch_add(e - b, std::memory_order_relaxed);
+                ins->report();
+            }
+        });
+        set_nelem(new_n);
+        if(ins) ins->report(true);
+    }
+    // Flushes a file-backed matrix to disk.
+    void sync() {
+        if(!mfbp_) return;
+        std::error_code ec;
+        mfbp_->sync(ec);
+        if(ec) throw std::system_error(ec, "Failed to sync " + path_);
+    }
+    DistanceMatrix<ArithType, DefaultValue> to_distance_matrix(Executor &ex=default_executor()) const {
+        DistanceMatrix<ArithType, DefaultValue> ret(nelem_, default_value_);
+        detail::transpose_triangle(data_, ret.data(), nelem_, false, ex);
+        return ret;
+    }
+    size_t write(const char *path, int compression_level=0, Instrumentation *ins=nullptr) const {
+        std::string fmt = compression_level ? (std::string("wb") + std::to_string(compression_level % 10)): std::string("wT");
+        gzFile fp = gzopen(std::strcmp(path, "-") ? path: "/dev/stdout", fmt.data());
+        if(!fp) throw std::runtime_error(std::string("Could not open file at ") + path);
+        size_t ret = write(fp, ins);
+        gzclose(fp);
+        if(ins) ins->report(true);
+        return ret;
+    }
+    size_t write(gzFile fp, Instrumentation *ins=nullptr) const {
+        const auto header = detail::serialized_header(magic_number(), nelem_);
+        size_t ret = detail::gzwrite_all(fp, header.data(), header.size());
+        ret += detail::gzwrite_all(fp, data_, sizeof(ArithType) * num_entries(), ins);
+        return ret;
+    }
+    void read(const char *path, Instrumentation *ins=nullptr) {
+        if(mfbp_) throw std::runtime_error("Can't read into a file-backed matrix");
+        path = std::strcmp(path, "-") ? path: "/dev/stdin";
+        gzFile fp = gzopen(path, "rb");
+        if(!fp) throw std::runtime_error(std::string("Could not open file at ") + path);
+        const int magic = gzgetc(fp);
+        uint64_t n;
+        if(magic != magic_number() || gzread(fp, &n, sizeof(n)) != sizeof(n)) {
+            gzclose(fp);
+            throw std::runtime_error(std::string("Not a growable distance matrix of this type: ") + path);
+        }
+        reserve_points(n);
+        nelem_ = n;
+        try {
+            detail::gzread_all(fp, data_, sizeof(ArithType) * num_entries(), ins);
+        } catch(...) {
+            gzclose(fp);
+            throw;
+        }
+        gzclose(fp);
+    }
+    bool operator==(const GrowableDistanceMatrix &o) const {
+        return nelem_ == o.nelem_ && std::equal(begin(), end(), o.begin());
+    }
+};
+
+/* *
+ * subset over a DistanceMatrixReader: one sequential pass over the (possibly compressed) file,
+ * keeping only the rows of selected points. Memory use is the output plus the reader's buffers.
+*/
+template<typename T>
+DistanceMatrix<T> subset(DistanceMatrixReader<T> &reader, const std::vector<size_t> &idx, Executor &ex=default_executor(), T diagval=T(0)) {
+    const auto order = detail::sorted_order(idx, reader.size());
+    DistanceMatrix<T> ret(idx.size(), diagval);
+    size_t a = 0;
+    typename DistanceMatrixReader<T>::RowBatch batch;
+    while(a < order.size() && reader.next(batch)) {
+        // Sorted positions whose source row is in this batch.
+        size_t aend = a;
+        while(aend < order.size() && idx[order[aend]] < batch.end_row()) ++aend;
+        parallel_for(ex, aend - a, [&](size_t ao, unsigned) {
+            const size_t r = idx[order[a + ao]];
+            detail::subset_row(batch.row_span(r).first, r, idx, order, a + ao, ret, diagval);
+        }, 1);
+        a = aend;
+    }
+    if(a < order.size()) throw std::runtime_error("Reader ended before all selected rows were seen");
+    return ret;
+}
+
+namespace detail {
+/*
+ * Bounded selection of the k best (value, index) pairs, best meaning smaller unless Largest.
+ * Ties are broken by index, so results do not depend on the order of pushes.
+ * The worst kept value sits at the top of a heap, and full heaps reject most candidates with one compare.
+ */
+template<typename T, bool Largest=false>
+class TopK {
+    std::vector<std::pair<T, uint64_t>> heap_;
+    size_t k_;
+public:
+    static bool better_item(const std::pair<T, uint64_t> &a, const std::pair<T, uint64_t> &b) {
+        return Largest ? (a.first > b.first || (a.first == b.first && a.second < b.second))
+                       : (a.first < b.first || (a.first == b.first && a.second < b.second));
+    }
+    static bool better(T a, T b) {return Largest ? a > b: a < b;}
+    explicit TopK(size_t k=0): k_(k) {heap_.reserve(k);}
+    void reset(size_t k) {heap_.clear(); k_ = k; heap_.reserve(k);}
+    size_t k() const {return k_;}
+    size_t size() const {return heap_.size();}
+    bool full() const {return heap_.size() == k_;}
+    // The value a candidate must beat (or tie) once full.
+    T threshold() const {return heap_.front().first;}
+    INLINE void push(T v, uint64_t idx) {
+        if(heap_.size() < k_) {
+            heap_.emplace_back(v, idx);
+            std::push_heap(heap_.begin(), heap_.end(), better_item);
+        } else if(k_ && !better(heap_.front().first, v)) {
+            const std::pair<T, uint64_t> item(v, idx);
+            if(!better_item(item, heap_.front())) return;
+            std::pop_heap(heap_.begin(), heap_.end(), better_item);
+            heap_.back() = item;
+            std::push_heap(heap_.begin(), heap_.end(), better_item);
+        }
+    }
+    // Pushes vals[i] with index first_index + i; rejected candidates cost a single compare.
+    void push_range(const T *vals, size_t n, uint64_t first_index) {
+        if(!k_) return; // full() holds for k == 0, but there is no threshold to compare to
+        size_t i = 0;
+        for(; i < n && !full(); ++i) push(vals[i], first_index + i);
+        for(; i < n; ++i)
+            if(!better(threshold(), vals[i])) push(vals[i], first_index + i);
+    }
+    void merge(const TopK &o) {
+        for(const auto &x: o.heap_) push(x.first, x.second);
+    }
+    // Returns the kept pairs, best first, and empties the heap.
+    std::vector<std::pair<T, uint64_t>> take_sorted() {
+        std::sort_heap(heap_.begin(), heap_.end(), better_item);
+        return std::move(heap_);
+    }
+};
+} // namespace detail
+
+/* *
+ * NeighborTable holds, for each of n points, its k nearest points (closest first) and their distances.
+ * Rows are stored contiguously: neighbor_indices[i * k + r] is the r-th neighbor of i.
+*/
+template<typename T>
+struct NeighborTable {
+    using index_type = uint32_t;
+    size_t n = 0, k = 0;
+    std::vector<index_type> neighbor_indices;
+    std::vector<T> neighbor_distances;
+    NeighborTable() {}
+    NeighborTable(size_t n_, size_t k_): n(n_), k(k_), neighbor_indices(n_ * k_), neighbor_distances(n_ * k_) {}
+    const index_type *indices(size_t i) const {return neighbor_indices.data() + i * k;}
+    const T *distances(size_t i) const {return neighbor_distances.data() + i * k;}
+    void set(size_t i, std::vector<std::pair<T, uint64_t>> &&sorted) {
+        assert(sorted.size() == k);
+        for(size_t r = 0; r < k; ++r) {
+            neighbor_distances[i * k + r] = sorted[r].first;
+            neighbor_indices[i * k + r] = sorted[r].second;
+        }
+    }
+};
+
+namespace detail {
+template<bool Largest, typename T, size_t defv>
+NeighborTable<T> knn_impl(const DistanceMatrix<T, defv> &mat, size_t k, Executor &ex) {
+    static constexpr size_t BLOCK = 128;
+    const size_t n = mat.size();
+    k = std::min(k, n ? n - 1: size_t(0));
+    NeighborTable<T> ret(n, k);
+    /*
+     * Each task owns a block of points [a, b). Their column parts are the segments [a, b) of rows j < b,
+     * which are contiguous; their row parts are rows a..b-1 in full. Every entry is thus read twice in total,
+     * sequentially, and no two tasks touch the same heaps.
+     */
+    parallel_for(ex, (n + BLOCK - 1) / BLOCK, [&](size_t blk, unsigned) {
+        const size_t a = blk * BLOCK, b = std::min(a + BLOCK, n);
+        std::vector<TopK<T, Largest>> heaps(b - a, TopK<T, Largest>(k));
+        for(size_t j = 0; j + 1 < b; ++j) {
+            const size_t c0 = std::max(j + 1, a);
+            const T *rp = mat.row_ptr(j);
+            for(size_t c = c0; c < b; ++c)
+                heaps[c - a].push(rp[c - j - 1], j);
+        }
+        for(size_t i = a; i < b; ++i) {
+            auto span = mat.row_span(i);
+            heaps[i - a].push_range(span.first, span.second, i + 1);
+            ret.set(i, heaps[i - a].take_sorted());
+        }
+    }, 1);
+    return ret;
+}
+
+template<bool Largest, typename T>
+NeighborTable<T> knn_impl(DistanceMatrixReader<T> &reader, size_t k, Executor &ex) {
+    const size_t n = reader.size();
+    k = std::min(k, n ? n - 1: size_t(0));
+    NeighborTable<T> ret(n, k);
+    std::vector<TopK<T, Largest>> heaps(n, TopK<T, Largest>(k));
+    // Targets are split into ranges owned by one task each; within a batch, a task reads the segments
+    // of every row that fall into its range, plus the full rows of its own points.
+    const size_t nranges = std::min(n, size_t(ex.concurrency()) * 4);
+    typename DistanceMatrixReader<T>::RowBatch batch;
+    while(reader.next(batch)) {
+        parallel_for(ex, nranges, [&](size_t ri, unsigned) {
+            const size_t t0 = ri * n / nranges, t1 = (ri + 1) * n / nranges;
+            for(size_t i = batch.first_row(); i < batch.end_row(); ++i) {
+                auto span = batch.row_span(i);
+                const T *rp = span.first;
+                for(size_t c = std::max(t0, i + 1); c < t1; ++c)
+                    heaps[c].push(rp[c - i - 1], i);
+                if(i >= t0 && i < t1)
+                    heaps[i].push_range(span.first, span.second, i + 1);
+            }
+        }, 1);
+    }
+    parallel_for(ex, n, [&](size_t i, unsigned) {ret.set(i, heaps[i].take_sorted());});
+    return ret;
+}
+} // namespace detail
+
+/* *
+ * knn returns each point's k nearest neighbors (or k farthest, for similarities, if largest is set),
+ * excluding the point itself; k is capped at n - 1.
+ * The DistanceMatrixReader overload streams the matrix once, keeping only the n * k candidates in memory.
+*/
+template<typename T, size_t defv>
+NeighborTable<T> knn(const DistanceMatrix<T, defv> &mat, size_t k, Executor &ex=default_executor(), bool largest=false) {
+    return largest ? detail::knn_impl<true>(mat, k, ex): detail::knn_impl<false>(mat, k, ex);
+}
+template<typename T>
+NeighborTable<T> knn(DistanceMatrixReader<T> &reader, size_t k, Executor &ex=default_executor(), bool largest=false) {
+    return largest ? detail::knn_impl<true>(reader, k, ex): detail::knn_impl<false>(reader, k, ex);
+}
+
+namespace detail {
+template<bool Largest, typename T>
+NeighborTable<T> knn_impl(const RectDistanceMatrix<T> &mat, size_t k, Executor &ex) {
+    if(mat.cols() > std::numeric_limits<typename NeighborTable<T>::index_type>::max())
+        throw std::invalid_argument("knn: too many columns for NeighborTable's 32-bit indices");
+    k = std::min(k, mat.cols());
+    NeighborTable<T> ret(mat.rows(), k);
+    parallel_for(ex, mat.rows(), [&](size_t i, unsigned) {
+        TopK<T, Largest> heap(k);
+        heap.push_range(mat.row_ptr(i), mat.cols(), 0);
+        ret.set(i, heap.take_sorted());
+    }, std::max(size_t(1), (size_t(1) << 16) / std::max(mat.cols(), size_t(1))));
+    return ret;
+}
+} // namespace detail
+
+/* *
+ * knn for a RectDistanceMatrix returns, for each row (query), its k nearest columns (references),
+ * or k farthest if largest is set; k is capped at the number of columns.
+*/
+template<typename T>
+NeighborTable<T> knn(const RectDistanceMatrix<T> &mat, size_t k, Executor &ex=default_executor(), bool largest=false) {
+    return largest ? detail::knn_impl<true>(mat, k, ex): detail::knn_impl<false>(mat, k, ex);
+}
+
+/* *
+ * PointStats holds, for each point, statistics over its distances to the n - 1 other points.
+ * Sums are accumulated in double for every ArithType.
+*/
+template<typename T>
+struct PointStats {
+    size_t n = 0;
+    std::vector<double> sum, sumsq;
+    std::vector<T> min;
+    std::vector<uint64_t> argmin; // smallest index among ties; uint64_t(-1) if n < 2
+    PointStats() {}
+    explicit PointStats(size_t n_): n(n_), sum(n_), sumsq(n_), min(n_, dm::numeric_limits<T>::max()), argmin(n_, uint64_t(-1)) {}
+    double mean(size_t i) const {return n > 1 ? sum[i] / (n - 1): 0.;}
+    double variance(size_t i) const {
+        if(n < 2) return 0.;
+        const double m = mean(i);
+        return std::max(sumsq[i] / (n - 1) - m * m, 0.);
+    }
+};
+
+namespace detail {
+/*
+ * Per-thread accumulators for the column parts of rows scanned by one thread.
+ * Every entry (i, c) of row i counts towards point i directly and towards point c through these.
+ */
+template<typename T>
+struct ColumnAccumulator {
+    std::vector<double> sum, sumsq;
+    std::vector<T> min;
+    std::vector<uint64_t> argmin;
+    void init(size_t n) {
+        sum.assign(n, 0.), sumsq.assign(n, 0.);
+        min.assign(n, dm::numeric_limits<T>::max()), argmin.assign(n, uint64_t(-1));
+    }
+    bool empty() const {return sum.empty();}
+};
+
+// Adds row i (its row_span) to stats[i] and, for columns in [c0, c1), to acc.
+template<typename T>
+INLINE void accumulate_row(const T *rp, size_t len, size_t i, size_t c0, size_t c1, PointStats<T> &stats, bool own_row, ColumnAccumulator<T> &acc) {
+    const size_t first = i + 1;
+    if(own_row) {
+        // Separate loops for the sums and the argmin keep each one simple enough to vectorize.
+        double s = 0., sq = 0.;
+        for(size_t j = 0; j < len; ++j) {
+            const double v = rp[j];
+            s += v;
+            sq += v * v;
+        }
+        T mn = stats.min[i];
+        uint64_t am = stats.argmin[i];
+        for(size_t j = 0; j < len; ++j)
+            if(rp[j] < mn || (rp[j] == mn && first + j < am)) mn = rp[j], am = first + j;
+        stats.sum[i] += s, stats.sumsq[i] += sq, stats.min[i] = mn, stats.argmin[i] = am;
+    }
+    c0 = std::max(c0, first);
+    double *const cs = acc.sum.data(), *const csq = acc.sumsq.data();
+    T *const cm = acc.min.data();
+    uint64_t *const ca = acc.argmin.data();
+    for(size_t c = c0; c < c1; ++c) {
+        const double v = rp[c - first];
+        cs[c] += v;
+        csq[c] += v * v;
+    }
+    for(size_t c = c0; c < c1; ++c) {
+        const T v = rp[c - first];
+        if(v < cm[c] || (v == cm[c] && i < ca[c])) cm[c] = v, ca[c] = i;
+    }
+}
+
+template<typename T>
+void merge_columns(PointStats<T> &stats, std::vector<ColumnAccumulator<T>> &accs, Executor &ex) {
+    parallel_for(ex, stats.n, [&](size_t i, unsigned) {
+        for(const auto &acc: accs) {
+            if(acc.empty()) continue;
+            stats.sum[i] += acc.sum[i];
+            stats.sumsq[i] += acc.sumsq[i];
+            if(acc.min[i] < stats.min[i] || (acc.min[i] == stats.min[i] && acc.argmin[i] < stats.argmin[i]))
+                stats.min[i] = acc.min[i], stats.argmin[i] = acc.argmin[i];
+        }
+    }, 4096);
+}
+} // namespace detail
+
+/* *
+ * point_stats computes every point's sum, sum of squares, minimum and argmin over all its distances
+ * in one pass over the condensed array. Each row contributes to its own point directly and to the
+ * points of its columns through per-thread accumulators (O(n) memory per thread), merged at the end.
+ * The DistanceMatrixReader overload does the same over a file, splitting columns between threads instead.
+*/
+template<typename T, size_t defv>
+PointStats<T> point_stats(const DistanceMatrix<T, defv> &mat, Executor &ex=default_executor()) {
+    const size_t n = mat.size();
+    PointStats<T> ret(n);
+    std::vector<detail::ColumnAccumulator<T>> accs(ex.concurrency());
+    ex.for_each_range(n, 16, [&](size_t b, size_t e, unsigned tid) {
+        auto &acc = accs[tid];
+        if(acc.empty()) acc.init(n);
+        for(size_t i = b; i < e; ++i) {
+            auto span = mat.row_span(i);
+            detail::accumulate_row(span.first, span.second, i, 0, n, ret, true, acc);
+        }
+    });
+    detail::merge_columns(ret, accs, ex);
+    return ret;
+}
+template<typename T>
+PointStats<T> point_stats(DistanceMatrixReader<T> &reader, Executor &ex=default_executor()) {
+    const size_t n = reader.size();
+    PointStats<T> ret(n);
+    const size_t nranges = std::min(n, size_t(ex.concurrency()) * 4);
+    std::vector<detail::ColumnAccumulator<T>> accs(1);
+    accs[0].init(n);
+    typename DistanceMatrixReader<T>::RowBatch batch;
+    while(reader.next(batch)) {
+        // Each task owns the columns [t0, t1) and the rows in that range, so nothing is shared.
+        parallel_for(ex, nranges, [&](size_t ri, unsigned) {
+            const size_t t0 = ri * n / nranges, t1 = (ri + 1) * n / nranges;
+            for(size_t i = batch.first_row(); i < batch.end_row(); ++i) {
+                auto span = batch.row_span(i);
+                detail::accumulate_row(span.first, span.second, i, t0, t1, ret, i >= t0 && i < t1, accs[0]);
+            }
+        }, 1);
+    }
+    detail::merge_columns(ret, accs, ex);
+    return ret;
+}
+
+namespace detail {
+// Sums of a - ka, b - kb, their squares and products; the shifts keep the single-pass formulas stable.
+struct PairSums {
+    double sa = 0., sb = 0., saa = 0., sbb = 0., sab = 0.;
+    PairSums &operator+=(const PairSums &o) {
+        sa += o.sa, sb += o.sb, saa += o.saa, sbb += o.sbb, sab += o.sab;
+        return *this;
+    }
+    double correlation(size_t m) const {
+        const double cov = sab - sa * sb / m, va = saa - sa * sa / m, vb = sbb - sb * sb / m;
+        return cov / std::sqrt(va * vb);
+    }
+};
+
+template<typename T1, typename T2>
+PairSums pair_sums(const T1 *a, const T2 *b, size_t m, Executor &ex) {
+    PairSums ret;
+    if(!m) return ret;
+    const double ka = a[0], kb = b[0];
+    std::vector<PairSums> sums(ex.concurrency());
+    ex.for_each_range(m, std::max(size_t(1) << 14, ex.default_grain(m)), [&](size_t beg, size_t e, unsigned tid) {
+        PairSums s;
+        for(size_t i = beg; i < e; ++i) {
+            const double x = double(a[i]) - ka, y = double(b[i]) - kb;
+            s.sa += x, s.sb += y, s.saa += x * x, s.sbb += y * y, s.sab += x * y;
+        }
+        sums[tid] += s;
+    });
+    for(const auto &s: sums) ret += s;
+    return ret;
+}
+
+// Sorts [first, last) by sorting one chunk per task and merging neighbouring runs pairwise.
+template<typename It, typename Cmp>
+void parallel_sort(It first, It last, Cmp cmp, Executor &ex) {
+    const size_t m = last - first;
+    const size_t nchunks = std::max(size_t(1), std::min(size_t(ex.concurrency()), m / 65536));
+    std::vector<size_t> bounds(nchunks + 1);
+    for(size_t i = 0; i <= nchunks; ++i) bounds[i] = i * m / nchunks;
+    parallel_for(ex, nchunks, [&](size_t i, unsigned) {std::sort(first + bounds[i], first + bounds[i + 1], cmp);}, 1);
+    for(size_t width = 1; width < nchunks; width *= 2) {
+        const size_t nmerges = (nchunks + 2 * width - 1) / (2 * width);
+        parallel_for(ex, nmerges, [&](size_t k, unsigned) {
+            const size_t lo = 2 * width * k, mid = std::min(lo + width, nchunks), hi = std::min(lo + 2 * width, nchunks);
+            if(mid < hi) std::inplace_merge(first + bounds[lo], first + bounds[mid], first + bounds[hi], cmp);
+        }, 1);
+    }
+}
+
+// Ranks (1-based, ties sharing their average rank) of x[0, m).
+template<typename T>
+std::vector<double> average_ranks(const T *x, size_t m, Executor &ex) {
+    std::vector<std::pair<T, uint64_t>> order(m);
+    parallel_for(ex, m, [&](size_t i, unsigned) {order[i] = {x[i], i};}, 1 << 16);
+    parallel_sort(order.begin(), order.end(), [](const std::pair<T, uint64_t> &l, const std::pair<T, uint64_t> &r) {return l.first < r.first;}, ex);
+    std::vector<double> ret(m);
+    for(size_t i = 0; i < m;) {
+        size_t e = i + 1;
+        while(e < m && !(order[i].first < order[e].first)) ++e;
+        const double r = 0.5 * double(i + e + 1);
+        for(size_t k = i; k < e; ++k) ret[order[k].second] = r;
+        i = e;
+    }
+    return ret;
+}
+
+// Scales x to zero mean and unit sum of squares, so the correlation of two such arrays is their dot product.
+inline void standardize(std::vector<double> &x, Executor &ex) {
+    const PairSums s = pair_sums(x.data(), x.data(), x.size(), ex);
+    const double m = x.size(), mean = x[0] + s.sa / m, norm = std::sqrt(s.saa - s.sa * s.sa / m);
+    const double scale = norm > 0. ? 1. / norm: 0.;
+    parallel_for(ex, x.size(), [&](size_t i, unsigned) {x[i] = (x[i] - mean) * scale;}, 1 << 16);
+}
+} // namespace detail
+
+enum class CorrelationMethod {PEARSON, SPEARMAN};
+
+/* *
+ * pearson and spearman correlate the condensed entries of two matrices of the same size.
+ * pearson is a single fused pass; spearman ranks each matrix (ties get their average rank) and correlates the ranks.
+*/
+template<typename T1, size_t d1, typename T2, size_t d2>
+double pearson(const DistanceMatrix<T1, d1> &a, const DistanceMatrix<T2, d2> &b, Executor &ex=default_executor()) {
+    if(a.size() != b.size()) throw std::invalid_argument("pearson: matrices differ in size");
+    return detail::pair_sums(a.data(), b.data(), a.num_entries(), ex).correlation(a.num_entries());
+}
+template<typename T1, size_t d1, typename T2, size_t d2>
+double spearman(const DistanceMatrix<T1, d1> &a, const DistanceMatrix<T2, d2> &b, Executor &ex=default_executor()) {
+    if(a.size() != b.size()) throw std::invalid_argument("spearman: matrices differ in size");
+    const auto ra = detail::average_ranks(a.data(), a.num_entries(), ex), rb = detail::average_ranks(b.data(), b.num_entries(), ex);
+    return detail::pair_sums(ra.data(), rb.data(), ra.size(), ex).correlation(ra.size());
+}
+
+struct MantelResult {
+    double statistic;                       // Correlation between the two matrices
+    double p_value;                         // (1 + #permutations with correlation >= statistic) / (1 + permutations)
+    std::vector<double> null_distribution;  // Correlation under each permutation, in generation order
+};
+
+/* *
+ * mantel runs a permutation Mantel test: b's points are relabelled at random and the correlation recomputed.
+ * Both matrices are standardized once up front (after ranking, for SPEARMAN), so each permuted correlation is
+ * a dot product. Permutations are evaluated BATCH at a time: each thread takes rows of a and, tile by tile,
+ * gathers the permuted entries of b for every permutation in the batch while the tile of a stays in cache.
+*/
+template<typename T1, size_t d1, typename T2, size_t d2>
+MantelResult mantel(const DistanceMatrix<T1, d1> &a, const DistanceMatrix<T2, d2> &b, size_t permutations=999,
+                    CorrelationMethod method=CorrelationMethod::PEARSON, uint64_t seed=0, Executor &ex=default_executor())
+{
+    static constexpr size_t BATCH = 8, TILE = 512;
+    const size_t n = a.size(), m = a.num_entries();
+    if(b.size() != n) throw std::invalid_argument("mantel: matrices differ in size");
+    if(n < 3) throw std::invalid_argument("mantel: need at least 3 points");
+    if(n > std::numeric_limits<uint32_t>::max()) throw std::invalid_argument("mantel: too many points");
+    std::vector<double> ca, cb;
+    if(method == CorrelationMethod::SPEARMAN) {
+        ca = detail::average_ranks(a.data(), m, ex), cb = detail::average_ranks(b.data(), m, ex);
+    } else {
+        ca.assign(a.data(), a.data() + m), cb.assign(b.data(), b.data() + m);
+    }
+    detail::standardize(ca, ex), detail::standardize(cb, ex);
+    MantelResult ret;
+    ret.statistic = detail::pair_sums(ca.data(), cb.data(), m, ex).correlation(m);
+    ret.null_distribution.resize(permutations);
+    const auto offsets = a.row_offsets();
+    const unsigned nt = ex.concurrency();
+    std::vector<uint32_t> perms(BATCH * n);
+    std::vector<double> acc(nt * BATCH);
+    std::mt19937_64 mt(seed);
+    for(size_t p0 = 0; p0 < permutations; p0 += BATCH) {
+        const size_t np = std::min(BATCH, permutations - p0);
+        for(size_t p = 0; p < np; ++p) {
+            uint32_t *const pp = perms.data() + p * n;
+            std::iota(pp, pp + n, 0u);
+            std::shuffle(pp, pp + n, mt);
+        }
+        std::fill(acc.begin(), acc.end(), 0.);
+        parallel_for(ex, n - 1, [&](size_t i, unsigned tid) {
+            const double *const arow = ca.data() + offsets[i];
+            const size_t len = n - i - 1;
+            double rowacc[BATCH]{};
+            for(size_t t0 = 0; t0 < len; t0 += TILE) {
+                const size_t t1 = std::min(len, t0 + TILE);
+                for(size_t p = 0; p < np; ++p) {
+                    const uint32_t *const pp = perms.data() + p * n + i + 1;
+                    const uint64_t pi = pp[-1];
+                    double s = 0.;
+                    for(size_t j = t0; j < t1; ++j) {
+                        const uint64_t pj = pp[j];
+                        s += arow[j] * (pi < pj ? cb[offsets[pi] + pj - pi - 1]: cb[offsets[pj] + pi - pj - 1]);
+                    }
+                    rowacc[p] += s;
+                }
+            }
+            for(size_t p = 0; p < np; ++p) acc[tid * BATCH + p] += rowacc[p];
+        }, 4);
+        for(size_t p = 0; p < np; ++p) {
+            double s = 0.;
+            for(unsigned t = 0; t < nt; ++t) s += acc[t * BATCH + p];
+            ret.null_distribution[p0 + p] = s;
+        }
+    }
+    // Allow for rounding differences between the observed and permuted sums.
+    const double tol = 1e-12 * std::max(1., std::abs(ret.statistic));
+    const size_t count = std::count_if(ret.null_distribution.begin(), ret.null_distribution.end(),
+                                       [&](double r) {return r >= ret.statistic - tol;});
+    ret.p_value = double(count + 1) / double(permutations + 1);
+    return ret;
+}
+
+namespace detail {
+// Calls func(ptr, len, tid) on contiguous chunks covering every entry of the source, in parallel.
+template<typename T, size_t defv, typename Func>
+void for_each_chunk(const DistanceMatrix<T, defv> &mat, Executor &ex, const Func &func) {
+    const T *const data = mat.data();
+    ex.for_each_range(mat.num_entries(), std::max(size_t(1) << 16, ex.default_grain(mat.num_entries())), [&](size_t b, size_t e, unsigned tid) {
+        func(data + b, e - b, tid);
+    });
+}
+template<typename T, typename Func>
+void for_each_chunk(DistanceMatrixReader<T> &reader, Executor &ex, const Func &func) {
+    typename DistanceMatrixReader<T>::RowBatch batch;
+    while(reader.next(batch)) {
+        const T *const data = batch.data();
+        const size_t m = batch.num_entries();
+        ex.for_each_range(m, std::max(size_t(1) << 16, ex.default_grain(m)), [&](size_t b, size_t e, unsigned tid) {
+            func(data + b, e - b, tid);
+        });
+    }
+}
+template<typename T, typename Func>
+void for_each_chunk(const RectDistanceMatrix<T> &mat, Executor &ex, const Func &func) {
+    const T *const data = mat.data();
+    ex.for_each_range(mat.num_entries(), std::max(size_t(1) << 16, ex.default_grain(mat.num_entries())), [&](size_t b, size_t e, unsigned tid) {
+        func(data + b, e - b, tid);
+    });
+}
+} // namespace detail
+
+/* *
+ * Histogram holds counts for nbins equal-width bins over [lo, hi]. Bins are half-open except the last, which includes hi.
+ * Entries below lo are counted in below; entries above hi, and NaNs, in above.
+*/
+struct Histogram {
+    double lo, hi;
+    std::vector<uint64_t> counts;
+    uint64_t below = 0, above = 0;
+    size_t nbins() const {return counts.size();}
+    double bin_lower(size_t i) const {return lo + (hi - lo) * double(i) / counts.size();}
+    uint64_t total() const {return std::accumulate(counts.begin(), counts.end(), below + above);}
+};
+
+/* *
+ * QuantileSketch is a KLL sketch: a stack of compactors where items at level h stand for 2^h inputs.
+ * When a level fills, it is sorted and every other item (starting at random) is promoted to the next level.
+ * With k items at the top level (shrinking by 2/3 per level below, to at least MIN_WIDTH), rank error is O(1/k)
+ * with high probability. Sketches merge by concatenating levels and compacting, so they can be built per thread.
+*/
+template<typename T>
+class QuantileSketch {
+    static constexpr size_t MIN_WIDTH = 8;
+    size_t k_;
+    uint64_t n_ = 0;
+    T min_ = T(), max_ = T();
+    std::vector<std::vector<T>> levels_;
+    std::vector<size_t> capacities_;
+    std::mt19937_64 rng_;
+    uint64_t coins_ = 0;
+    unsigned ncoins_ = 0;
+
+    void add_level() {
+        levels_.emplace_back();
+        capacities_.resize(levels_.size());
+        const size_t nl = levels_.size();
+        for(size_t h = 0; h < nl; ++h)
+            capacities_[h] = std::max(size_t(MIN_WIDTH), size_t(std::ceil(k_ * std::pow(2. / 3., double(nl - 1 - h)))));
+    }
+    bool coin() {
+        if(!ncoins_) coins_ = rng_(), ncoins_ = 64;
+        --ncoins_;
+        return (coins_ >> ncoins_) & 1;
+    }
+    void compact(size_t h) {
+        if(h + 1 == levels_.size()) add_level();
+        auto &lv = levels_[h], &up = levels_[h + 1];
+        std::sort(lv.begin(), lv.end());
+        // With an odd count the largest item stays behind, so the total weight is preserved exactly.
+        const size_t npairs = lv.size() / 2, offset = coin();
+        for(size_t i = 0; i < npairs; ++i) up.push_back(lv[2 * i + offset]);
+        lv.erase(lv.begin(), lv.begin() + 2 * npairs);
+    }
+    void compress() {
+        for(;;) {
+            size_t total = 0, capacity = 0;
+            for(size_t h = 0; h < levels_.size(); ++h) total += levels_[h].size(), capacity += capacities_[h];
+            if(total <= capacity) return;
+            for(size_t h = 0; h < levels_.size(); ++h)
+                if(levels_[h].size() >= capacities_[h]) {compact(h); break;}
+        }
+    }
+    std::vector<std::pair<T, uint64_t>> weighted_items() const {
+        std::vector<std::pair<T, uint64_t>> ret;
+        for(size_t h = 0; h < levels_.size(); ++h)
+            for(const auto v: levels_[h]) ret.emplace_back(v, uint64_t(1) << h);
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    }
+public:
+    explicit QuantileSketch(size_t k=200, uint64_t seed=0): k_(std::max(k, size_t(MIN_WIDTH))), rng_(seed) {add_level();}
+    void update(T x) {
+        if(!n_++) min_ = max_ = x;
+        else min_ = std::min(min_, x), max_ = std::max(max_, x);
+        levels_[0].push_back(x);
+        if(levels_[0].size() >= capacities_[0]) compress();
+    }
+    void update(const T *x, size_t len) {for(size_t i = 0; i < len; ++i) update(x[i]);}
+    void merge(const QuantileSketch &o) {
+        if(!o.n_) return;
+        if(!n_) min_ = o.min_, max_ = o.max_;
+        else min_ = std::min(min_, o.min_), max_ = std::max(max_, o.max_);
+        n_ += o.n_;
+        while(levels_.size() < o.levels_.size()) add_level();
+        for(size_t h = 0; h < o.levels_.size(); ++h)
+            levels_[h].insert(levels_[h].end(), o.levels_[h].begin(), o.levels_[h].end());
+        compress();
+    }
+    uint64_t size() const {return n_;}
+    size_t num_retained() const {
+        size_t ret = 0;
+        for(const auto &lv: levels_) ret += lv.size();
+        return ret;
+    }
+    // Approximate q-quantile, q in [0, 1]; 0 and 1 give the exact minimum and maximum.
+    T quantile(double q) const {
+        if(!n_) throw std::out_of_range("QuantileSketch::quantile: empty sketch");
+        if(q <= 0.) return min_;
+        if(q >= 1.) return max_;
+        const double target = q * n_;
+        uint64_t cum = 0;
+        for(const auto &item: weighted_items())
+            if((cum += item.second) >= target) return item.first;
+        return max_;
+    }
+    std::vector<T> quantiles(const std::vector<double> &qs) const {
+        std::vector<T> ret;
+        for(const auto q: qs) ret.push_back(quantile(q));
+        return ret;
+    }
+    // Approximate fraction of inputs <= x.
+    double rank(T x) const {
+        if(!n_) return 0.;
+        uint64_t cum = 0;
+        for(size_t h = 0; h < levels_.size(); ++h)
+            for(const auto v: levels_[h]) cum += uint64_t(!(x < v)) << h;
+        return double(cum) / n_;
+    }
+};
+
+/* *
+ * histogram, quantile_sketch and count_below each make one parallel pass over every stored distance,
+ * with per-thread partial results merged at the end. src may be a DistanceMatrix, a RectDistanceMatrix or a DistanceMatrixReader,
+ * in which case batches are read (and decompressed) in the background while the previous one is scanned.
+*/
+template<typename Source>
+Histogram histogram(Source &src, size_t nbins, double lo, double hi, Executor &ex=default_executor()) {
+    if(!nbins || !(lo < hi)) throw std::invalid_argument("histogram: need nbins > 0 and lo < hi");
+    std::vector<std::vector<uint64_t>> local(ex.concurrency());
+    const double scale = nbins / (hi - lo);
+    detail::for_each_chunk(src, ex, [&](const auto *p, size_t len, unsigned tid) {
+        auto &counts = local[tid];
+        if(counts.empty()) counts.assign(nbins + 2, 0);
+        for(size_t i = 0; i < len; ++i) {
+            const double v = p[i];
+            if(v < lo) ++counts[nbins];
+            else if(!(v <= hi)) ++counts[nbins + 1];
+            else ++counts[std::min(size_t((v - lo) * scale), nbins - 1)];
+        }
+    });
+    Histogram ret{lo, hi, std::vector<uint64_t>(nbins)};
+    for(const auto &counts: local) {
+        if(counts.empty()) continue;
+        for(size_t i = 0; i < nbins; ++i) ret.counts[i] += counts[i];
+        ret.below += counts[nbins], ret.above += counts[nbins + 1];
+    }
+    return ret;
+}
+
+template<typename Source, typename T=typename std::decay_t<Source>::value_type>
+QuantileSketch<T> quantile_sketch(Source &src, size_t k=200, uint64_t seed=0, Executor &ex=default_executor()) {
+    std::vector<QuantileSketch<T>> local;
+    for(unsigned t = 0; t < ex.concurrency(); ++t) local.emplace_back(k, seed + t);
+    detail::for_each_chunk(src, ex, [&](const T *p, size_t len, unsigned tid) {local[tid].update(p, len);});
+    for(size_t t = 1; t < local.size(); ++t) local[0].merge(local[t]);
+    return std::move(local[0]);
+}
+
+// Number of stored distances below threshold (or equal to it too, if inclusive).
+template<typename Source>
+uint64_t count_below(Source &src, double threshold, bool inclusive=false, Executor &ex=default_executor()) {
+    std::vector<uint64_t> local(ex.concurrency());
+    detail::for_each_chunk(src, ex, [&](const auto *p, size_t len, unsigned tid) {
+        uint64_t c = 0;
+        if(inclusive) for(size_t i = 0; i < len; ++i) c += double(p[i]) <= threshold;
+        else          for(size_t i = 0; i < len; ++i) c += double(p[i]) < threshold;
+        local[tid] += c;
+    });
+    return std::accumulate(local.begin(), local.end(), uint64_t(0));
+}
+
+/* *
+ * Edge is a pair of points with the distance between them, with i < j unless noted otherwise.
+*/
+template<typename T>
+struct Edge {
+    uint64_t i, j;
+    T dist;
+};
+
+namespace detail {
+// Row boundaries splitting rows [r0, r1) of an n-point triangle into nranges ranges of about equal numbers of entries.
+inline std::vector<size_t> balanced_rows(size_t n, size_t r0, size_t r1, size_t nranges) {
+    auto before = [n](size_t i) {return i * n - i * (i + 1) / 2;};
+    nranges = std::max(size_t(1), std::min(nranges, r1 - r0));
+    std::vector<size_t> ret(nranges + 1, r1);
+    ret[0] = r0;
+    const size_t e0 = before(r0), m = before(r1) - e0;
+    size_t i = r0;
+    for(size_t r = 1; r < nranges; ++r) {
+        const size_t target = e0 + m / nranges * r;
+        while(i < r1 && before(i) < target) ++i;
+        ret[r] = i;
+    }
+    return ret;
+}
+
+/*
+ * Appends the pairs of rows [r0, r1) whose distance is below cutoff (or equal to it, if inclusive) to out, in order.
+ * Each row is first compressed into the positions that pass, without branching, using scratch.
+ */
+template<typename T, size_t defv>
+void collect_edges(const DistanceMatrix<T, defv> &mat, size_t r0, size_t r1, double cutoff, bool inclusive,
+                   std::vector<uint32_t> &scratch, std::vector<Edge<T>> &out)
+{
+    scratch.resize(mat.size());
+    uint32_t *const pos = scratch.data();
+    for(size_t i = r0; i < r1; ++i) {
+        const auto span = mat.row_span(i);
+        const T *const p = span.first;
+        size_t cnt = 0;
+        if(inclusive) for(size_t j = 0; j < span.second; ++j) pos[cnt] = j, cnt += double(p[j]) <= cutoff;
+        else          for(size_t j = 0; j < span.second; ++j) pos[cnt] = j, cnt += double(p[j]) < cutoff;
+        for(size_t c = 0; c < cnt; ++c) out.push_back(Edge<T>{i, i + 1 + pos[c], p[pos[c]]});
+    }
+}
+
+template<typename T>
+void append_edge(std::string &out, const Edge<T> &e, bool binary) {
+    if(binary) {
+        char buf[2 * sizeof(uint64_t) + sizeof(T)];
+        std::memcpy(buf, &e.i, sizeof(uint64_t));
+        std::memcpy(buf + sizeof(uint64_t), &e.j, sizeof(uint64_t));
+        std::memcpy(buf + 2 * sizeof(uint64_t), &e.dist, sizeof(T));
+        out.append(buf, sizeof(buf));
+        return;
+    }
+    char buf[96];
+    int len;
+    if(std::is_floating_point<T>::value)
+        len = std::snprintf(buf, sizeof(buf), "%" PRIu64 "\t%" PRIu64 "\t%.*g\n", e.i, e.j, std::numeric_limits<T>::max_digits10, double(e.dist));
+    else if(std::is_signed<T>::value)
+        len = std::snprintf(buf, sizeof(buf), "%" PRIu64 "\t%" PRIu64 "\t%" PRId64 "\n", e.i, e.j, int64_t(e.dist));
+    else
+        len = std::snprintf(buf, sizeof(buf), "%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n", e.i, e.j, uint64_t(e.dist));
+    out.append(buf, len);
+}
+} // namespace detail
+
+/* *
+ * threshold_edges returns every pair closer than cutoff (or at it, if inclusive) as an edge list sorted by (i, j).
+ * Rows are split into ranges of equal work, each range collects its edges into its own buffer,
+ * and the buffers are concatenated in order.
+*/
+template<typename T, size_t defv>
+std::vector<Edge<T>> threshold_edges(const DistanceMatrix<T, defv> &mat, double cutoff, bool inclusive=false, Executor &ex=default_executor()) {
+    const auto bounds = detail::balanced_rows(mat.size(), 0, mat.size(), size_t(ex.concurrency()) * 8);
+    const size_t nranges = bounds.size() - 1;
+    std::vector<std::vector<Edge<T>>> parts(nranges);
+    std::vector<std::vector<uint32_t>> scratch(ex.concurrency());
+    parallel_for(ex, nranges, [&](size_t r, unsigned tid) {
+        detail::collect_edges(mat, bounds[r], bounds[r + 1], cutoff, inclusive, scratch[tid], parts[r]);
+    }, 1);
+    std::vector<size_t> starts(nranges + 1, 0);
+    for(size_t r = 0; r < nranges; ++r) starts[r + 1] = starts[r] + parts[r].size();
+    std::vector<Edge<T>> ret(starts.back());
+    parallel_for(ex, nranges, [&](size_t r, unsigned) {
+        std::copy(parts[r].begin(), parts[r].end(), ret.begin() + starts[r]);
+        std::vector<Edge<T>>().swap(parts[r]);
+    }, 1);
+    return ret;
+}
+
+/* *
+ * threshold_edges for a RectDistanceMatrix returns every (row, column) pair closer than cutoff
+ * (or at it, if inclusive), sorted by (i, j); here i is a row and j a column, so i < j need not hold.
+*/
+template<typename T>
+std::vector<Edge<T>> threshold_edges(const RectDistanceMatrix<T> &mat, double cutoff, bool inclusive=false, Executor &ex=default_executor()) {
+    const size_t nrows = mat.rows(), ncols = mat.cols();
+    const size_t nranges = std::max(size_t(1), std::min(nrows, size_t(ex.concurrency()) * 8));
+    std::vector<std::vector<Edge<T>>> parts(nranges);
+    std::vector<std::vector<uint64_t>> scratch(ex.concurrency()); // uint64_t: rows may have more than 2^32 columns
+    parallel_for(ex, nranges, [&](size_t r, unsigned tid) {
+        auto &pos = scratch[tid];
+        pos.resize(ncols);
+        for(size_t i = r * nrows / nranges, e = (r + 1) * nrows / nranges; i < e; ++i) {
+            const T *const p = mat.row_ptr(i);
+            size_t cnt = 0;
+            if(inclusive) for(size_t j = 0; j < ncols; ++j) pos[cnt] = j, cnt += double(p[j]) <= cutoff;
+            else          for(size_t j = 0; j < ncols; ++j) pos[cnt] = j, cnt += double(p[j]) < cutoff;
+            for(size_t c = 0; c < cnt; ++c) parts[r].push_back(Edge<T>{i, pos[c], p[pos[c]]});
+        }
+    }, 1);
+    std::vector<size_t> starts(nranges + 1, 0);
+    for(size_t r = 0; r < nranges; ++r) starts[r + 1] = starts[r] + parts[r].size();
+    std::vector<Edge<T>> ret(starts.back());
+    parallel_for(ex, nranges, [&](size_t r, unsigned) {
+        std::copy(parts[r].begin(), parts[r].end(), ret.begin() + starts[r]);
+        std::vector<Edge<T>>().swap(parts[r]);
+    }, 1);
+    return ret;
+}
+
+/* *
+ * EdgeFormat selects write_edges's output:
+ * TEXT is one "i<TAB>j<TAB>dist" line per edge. BINARY is packed records of i and j as uint64_t followed by dist as T,
+ * in native byte order with no header.
+*/
+enum class EdgeFormat {TEXT, BINARY};
+
+/* *
+ * write_edges writes threshold_edges(mat, cutoff, inclusive) to path ("-" for stdout) without holding them all:
+ * rows are taken a block at a time, threads collect and format the edges of their ranges into separate buffers,
+ * and the buffers are written in order. Returns the number of edges written.
+*/
+template<typename T, size_t defv>
+uint64_t write_edges(const DistanceMatrix<T, defv> &mat, const char *path, double cutoff, EdgeFormat format=EdgeFormat::TEXT,
+                     bool inclusive=false, Executor &ex=default_executor())
+{
+    static constexpr size_t ENTRIES_PER_BLOCK = size_t(1) << 26;
+    const size_t n = mat.size();
+    const bool use_stdout = std::strcmp(path, "-") == 0;
+    const int fd = detail::open_output(path);
+    const unsigned nt = ex.concurrency();
+    std::vector<std::vector<uint32_t>> scratch(nt);
+    std::vector<std::vector<Edge<T>>> edges(nt);
+    std::vector<std::string> parts;
+    uint64_t ret = 0;
+    try {
+        for(size_t first = 0; first < n;) {
+            size_t last = first, nentries = 0;
+            while(last < n && (last == first || nentries < ENTRIES_PER_BLOCK)) nentries += n - ++last;
+            const auto bounds = detail::balanced_rows(n, first, last, size_t(nt) * 4);
+            parts.assign(bounds.size() - 1, std::string());
+            std::vector<uint64_t> counts(parts.size());
+            parallel_for(ex, parts.size(), [&](size_t r, unsigned tid) {
+                auto &buf = edges[tid];
+                buf.clear();
+                detail::collect_edges(mat, bounds[r], bounds[r + 1], cutoff, inclusive, scratch[tid], buf);
+                for(const auto &e: buf) detail::append_edge(parts[r], e, format == EdgeFormat::BINARY);
+                counts[r] = buf.size();
+            }, 1);
+            for(size_t r = 0; r < parts.size(); ++r) {
+                detail::write_all(fd, parts[r].data(), parts[r].size());
+                ret += counts[r];
+            }
+            first = last;
+        }
+    } catch(...) {
+        if(!use_stdout) ::close(fd);
+        throw;
+    }
+    if(!use_stdout) ::close(fd);
+    return ret;
+}
+
+/* *
+ * CSRGraph is a symmetric adjacency in compressed sparse row form: the neighbors of point i (ascending)
+ * are indices[offsets[i]:offsets[i + 1]], with the distances in weights at the same positions.
+*/
+template<typename T>
+struct CSRGraph {
+    using index_type = uint32_t;
+    size_t n = 0;
+    std::vector<uint64_t> offsets;
+    std::vector<index_type> indices;
+    std::vector<T> weights;
+    size_t num_edges() const {return indices.size() / 2;}
+    size_t degree(size_t i) const {return offsets[i + 1] - offsets[i];}
+    const index_type *neighbors(size_t i) const {return indices.data() + offsets[i];}
+    const T *neighbor_weights(size_t i) const {return weights.data() + offsets[i];}
+};
+
+/* *
+ * csr_graph builds the graph joining every pair closer than cutoff (or at it, if inclusive) from threshold_edges.
+ * Scattering the sorted edge list in order leaves every neighbor list sorted without a further sort.
+*/
+template<typename T, size_t defv>
+CSRGraph<T> csr_graph(const DistanceMatrix<T, defv> &mat, double cutoff, bool inclusive=false, Executor &ex=default_executor()) {
+    const size_t n = mat.size();
+    if(n > std::numeric_limits<uint32_t>::max()) throw std::invalid_argument("csr_graph: too many points");
+    const auto edges = threshold_edges(mat, cutoff, inclusive, ex);
+    CSRGraph<T> ret;
+    ret.n = n;
+    ret.offsets.assign(n + 1, 0);
+    for(const auto &e: edges) ++ret.offsets[e.i + 1], ++ret.offsets[e.j + 1];
+    std::partial_sum(ret.offsets.begin(), ret.offsets.end(), ret.offsets.begin());
+    ret.indices.resize(2 * edges.size());
+    ret.weights.resize(2 * edges.size());
+    std::vector<uint64_t> fill(ret.offsets.begin(), ret.offsets.end() - 1);
+    for(const auto &e: edges) {
+        ret.indices[fill[e.i]] = e.j, ret.weights[fill[e.i]++] = e.dist;
+        ret.indices[fill[e.j]] = e.i, ret.weights[fill[e.j]++] = e.dist;
+    }
+    return ret;
+}
+
+namespace detail {
+template<bool Largest, typename T, size_t defv>
+std::vector<Edge<T>> top_k_pairs_impl(const DistanceMatrix<T, defv> &mat, size_t k, Executor &ex) {
+    static constexpr size_t BLOCK = 4096;
+    using Heap = TopK<T, Largest>;
+    const size_t m = mat.num_entries();
+    k = std::min(k, m);
+    std::vector<Heap> heaps(ex.concurrency(), Heap(k));
+    /*
+     * shared holds the tightest threshold of any full per-thread heap: a thread holding k entries at least
+     * as good means anything strictly worse can be dropped everywhere. Comparisons go through double,
+     * which rounds monotonically, so the filter can only let extra candidates through, never drop one.
+     */
+    std::atomic<double> shared(Largest ? -std::numeric_limits<double>::infinity(): std::numeric_limits<double>::infinity());
+    const T *const data = mat.data();
+    if(k) ex.for_each_range(m, std::max(size_t(1) << 16, ex.default_grain(m)), [&](size_t b, size_t e, unsigned tid) {
+        auto &heap = heaps[tid];
+        uint32_t pos[BLOCK];
+        for(size_t b0 = b; b0 < e; b0 += BLOCK) {
+            const size_t len = std::min(size_t(BLOCK), e - b0);
+            const T *const p = data + b0;
+            if(!heap.full()) {
+                heap.push_range(p, len, b0);
+            } else {
+                double cut = shared.load(std::memory_order_relaxed);
+                const double own = heap.threshold();
+                if(Largest ? own > cut: own < cut) cut = own;
+                size_t cnt = 0;
+                if(Largest) for(size_t j = 0; j < len; ++j) pos[cnt] = j, cnt += double(p[j]) >= cut;
+                else        for(size_t j = 0; j < len; ++j) pos[cnt] = j, cnt += double(p[j]) <= cut;
+                for(size_t c = 0; c < cnt; ++c) heap.push(p[pos[c]], b0 + pos[c]);
+            }
+            if(heap.full()) {
+                const double own = heap.threshold();
+                double cur = shared.load(std::memory_order_relaxed);
+                while((Largest ? own > cur: own < cur) && !shared.compare_exchange_weak(cur, own, std::memory_order_relaxed));
+            }
+        }
+    });
+    for(size_t t = 1; t < heaps.size(); ++t) heaps[0].merge(heaps[t]);
+    const auto offsets = mat.row_offsets();
+    std::vector<Edge<T>> ret;
+    ret.reserve(k);
+    for(const auto &item: heaps[0].take_sorted()) {
+        const uint64_t i = std::upper_bound(offsets.begin(), offsets.end(), item.second) - offsets.begin() - 1;
+        ret.push_back(Edge<T>{i, i + 1 + (item.second - offsets[i]), item.first});
+    }
+    return ret;
+}
+} // namespace detail
+
+/* *
+ * top_k_pairs returns the k smallest (or, if largest, the largest) off-diagonal distances as edges, best first,
+ * with ties broken by (i, j). Each thread scans contiguous stretches of the condensed array into its own bounded heap;
+ * once its heap is full, whole blocks are filtered against the tightest threshold published by any thread,
+ * so almost every entry costs one compare.
+*/
+template<typename T, size_t defv>
+std::vector<Edge<T>> top_k_pairs(const DistanceMatrix<T, defv> &mat, size_t k, bool largest=false, Executor &ex=default_executor()) {
+    return largest ? detail::top_k_pairs_impl<true>(mat, k, ex): detail::top_k_pairs_impl<false>(mat, k, ex);
+}
+
+/* *
+ * minimum_spanning_tree runs Prim's algorithm on the complete graph of mat in O(n^2) time and O(n) extra memory.
+ * After each point v joins the tree, every other point's distance to the tree is updated from v's row
+ * (streamed through row_span) and column (gathered from the earlier rows), fused with a parallel
+ * min-reduction that picks the next point. Returns the n - 1 edges sorted by distance (stably).
+*/
+template<typename T, size_t defv>
+std::vector<Edge<T>> minimum_spanning_tree(const DistanceMatrix<T, defv> &mat, Executor &ex=default_executor()) {
+    static constexpr size_t PARALLEL_MIN = 4096;
+    const size_t n = mat.size();
+    std::vector<Edge<T>> ret;
+    if(n < 2) return ret;
+    ret.reserve(n - 1);
+    const auto offsets = mat.row_offsets();
+    const T *const data = mat.data();
+    std::vector<uint64_t> nearest(n, 0);
+    std::vector<double> best(n, std::numeric_limits<double>::infinity());
+    std::vector<uint8_t> in_tree(n, 0);
+    const unsigned nt = ex.concurrency();
+    using Candidate = std::pair<double, uint64_t>;
+    std::vector<Candidate> thread_best(nt);
+    uint64_t v = 0;
+    in_tree[0] = 1;
+    for(size_t step = 1; step < n; ++step) {
+        std::fill(thread_best.begin(), thread_best.end(), Candidate(std::numeric_limits<double>::infinity(), uint64_t(-1)));
+        const T *const rowv = data + offsets[v];
+        auto update = [&](size_t b, size_t e, unsigned tid) {
+            Candidate tb = thread_best[tid];
+            for(size_t i = b; i < e; ++i) {
+                if(in_tree[i]) continue;
+                const double d = i < v ? data[offsets[i] + v - i - 1]: rowv[i - v - 1];
+                if(d < best[i]) best[i] = d, nearest[i] = v;
+                if(best[i] < tb.first || tb.second == uint64_t(-1)) tb = Candidate(best[i], i);
+            }
+            if(tb.first < thread_best[tid].first || (tb.first == thread_best[tid].first && tb.second < thread_best[tid].second))
+                thread_best[tid] = tb;
+        };
+        if(n < PARALLEL_MIN) update(0, n, 0);
+        else ex.for_each_range(n, std::max(size_t(4096), ex.default_grain(n)), update);
+        v = std::min_element(thread_best.begin(), thread_best.end())->second;
+        in_tree[v] = 1;
+        ret.push_back(Edge<T>{std::min(v, nearest[v]), std::max(v, nearest[v]), static_cast<T>(best[v])});
+    }
+    std::stable_sort(ret.begin(), ret.end(), [](const Edge<T> &a, const Edge<T> &b) {return a.dist < b.dist;});
+    return ret;
+}
+
+/* *
+ * Single-linkage clusters (connected components of the graph of pairs with distance <= cutoff)
+ * from a minimum spanning tree, such as minimum_spanning_tree's output (which must be sorted by distance).
+ * Labels run from 0 in order of each cluster's smallest point.
+ * The multi-cutoff overload sweeps the edges once with a union-find, for any number of cutoffs.
+*/
+template<typename T>
+std::vector<std::vector<uint32_t>> single_linkage_clusters(const std::vector<Edge<T>> &mst, size_t n, const std::vector<double> &cutoffs) {
+    std::vector<size_t> order(cutoffs.size());
+    std::iota(order.begin(), order.end(), size_t(0));
+    std::sort(order.begin(), order.end(), [&cutoffs](size_t a, size_t b) {return cutoffs[a] < cutoffs[b];});
+    std::vector<uint64_t> parent(n);
+    std::iota(parent.begin(), parent.end(), uint64_t(0));
+    auto find = [&parent](uint64_t x) {
+        while(parent[x] != x) x = parent[x] = parent[parent[x]];
+        return x;
+    };
+    std::vector<std::vector<uint32_t>> ret(cutoffs.size());
+    size_t ei = 0;
+    for(const size_t ci: order) {
+        for(; ei < mst.size() && mst[ei].dist <= cutoffs[ci]; ++ei) {
+            const uint64_t a = find(mst[ei].i), b = find(mst[ei].j);
+            // Keep the smaller index as root, so labels follow each cluster's smallest point.
+            if(a < b) parent[b] = a;
+            else      parent[a] = b;
+        }
+        auto &labels = ret[ci];
+        labels.resize(n);
+        uint32_t nlabels = 0;
+        for(size_t i = 0; i < n; ++i) {
+            const uint64_t root = find(i);
+            labels[i] = root == i ? nlabels++: labels[root];
+        }
+    }
+    return ret;
+}
+template<typename T>
+std::vector<uint32_t> single_linkage_clusters(const std::vector<Edge<T>> &mst, size_t n, double cutoff) {
+    return std::move(single_linkage_clusters(mst, n, std::vector<double>{cutoff})[0]);
+}
+template<typename T, size_t defv>
+std::vector<std::vector<uint32_t>> single_linkage_clusters(const DistanceMatrix<T, defv> &mat, const std::vector<double> &cutoffs, Executor &ex=default_executor()) {
+    return single_linkage_clusters(minimum_spanning_tree(mat, ex), mat.size(), cutoffs);
+}
+
+/* *
+ * LinkageMatrix is the result of hierarchical clustering in scipy's layout:
+ * row i = (cluster a, cluster b, distance, number of points), row-major in z,
+ * where clusters < n are points and cluster n + i is the one formed at row i.
+ * Rows are sorted by distance, so z can be handed to scipy.cluster.hierarchy unchanged.
+*/
+struct LinkageMatrix {
+    size_t n = 0;
+    std::vector<double> z;
+    size_t size() const {return n ? n - 1: size_t(0);}
+    double *row(size_t i) {return &z[i * 4];}
+    const double *row(size_t i) const {return &z[i * 4];}
+};
+
+enum class LinkageMethod {
+    SINGLE,
+    COMPLETE,
+    AVERAGE,  // UPGMA
+    WEIGHTED, // WPGMA
+    WARD
+};
+
+namespace detail {
+struct Merge {
+    uint64_t x, y;
+    double dist;
+};
+
+// Sorts merges by distance (stably) and relabels them as scipy does, with a union-find over cluster ids.
+inline LinkageMatrix linkage_from_merges(size_t n, std::vector<Merge> &merges) {
+    std::stable_sort(merges.begin(), merges.end(), [](const Merge &a, const Merge &b) {return a.dist < b.dist;});
+    LinkageMatrix ret;
+    ret.n = n;
+    ret.z.resize(ret.size() * 4);
+    std::vector<uint64_t> parent(2 * n), csize(2 * n, 1);
+    for(size_t i = 0; i < parent.size(); ++i) parent[i] = i;
+    auto find = [&parent](uint64_t x) {
+        uint64_t r = x;
+        while(parent[r] != r) r = parent[r];
+        while(parent[x] != r) {const uint64_t nx = parent[x]; parent[x] = r; x = nx;}
+        return r;
+    };
+    for(size_t i = 0; i < merges.size(); ++i) {
+        const uint64_t a = find(merges[i].x), b = find(merges[i].y), label = n + i;
+        parent[a] = parent[b] = label;
+        csize[label] = csize[a] + csize[b];
+        double *row = ret.row(i);
+        row[0] = std::min(a, b);
+        row[1] = std::max(a, b);
+        row[2] = merges[i].dist;
+        row[3] = csize[label];
+    }
+    return ret;
+}
+
+// Lance-Williams update for the distance between cluster k and the union of clusters x and y.
+inline double lance_williams(LinkageMethod method, double dkx, double dky, double dxy, double nx, double ny, double nk) {
+    switch(method) {
+        case LinkageMethod::SINGLE:   return std::min(dkx, dky);
+        case LinkageMethod::COMPLETE: return std::max(dkx, dky);
+        case LinkageMethod::AVERAGE:  return (nx * dkx + ny * dky) / (nx + ny);
+        case LinkageMethod::WEIGHTED: return .5 * (dkx + dky);
+        case LinkageMethod::WARD: {
+            const double t = 1. / (nx + ny + nk);
+            return std::sqrt((nx + nk) * t * dkx * dkx + (ny + nk) * t * dky * dky - nk * t * dxy * dxy);
+        }
+    }
+    throw std::invalid_argument("Unknown linkage method");
+}
+
+// Below this many active points, per-step work is done on the calling thread.
+static constexpr size_t LINKAGE_PARALLEL_MIN = 4096;
+
+/*
+ * Nearest-neighbor chain clustering for reducible linkages, in O(n^2) time.
+ * Distances to merged clusters are written over mat's storage: the union of x < y lives on at y.
+ * Both the nearest-neighbor search and the row update are split across ex once enough points remain.
+ */
+template<typename T, size_t defv>
+std::vector<Merge> nn_chain(DistanceMatrix<T, defv> &mat, LinkageMethod method, Executor &ex) {
+    const size_t n = mat.size();
+    std::vector<Merge> ret;
+    if(n < 2) return ret;
+    ret.reserve(n - 1);
+    const auto offsets = mat.row_offsets();
+    T *const data = mat.data();
+    auto at = [&](size_t i, size_t j) -> T & {return i < j ? data[offsets[i] + j - i - 1]: data[offsets[j] + i - j - 1];};
+    std::vector<uint64_t> active(n), pos(n), csize(n, 1);
+    for(size_t i = 0; i < n; ++i) active[i] = pos[i] = i;
+    auto deactivate = [&](uint64_t x) {
+        const uint64_t last = active.back();
+        active[pos[x]] = last;
+        pos[last] = pos[x];
+        active.pop_back();
+    };
+    const unsigned nt = ex.concurrency();
+    std::vector<std::pair<double, uint64_t>> thread_best(nt);
+    std::vector<uint64_t> chain;
+    while(active.size() > 1) {
+        if(chain.empty()) chain.push_back(active.front());
+        uint64_t x, y;
+        double dmin;
+        for(;;) {
+            x = chain.back();
+            y = chain.size() >= 2 ? chain[chain.size() - 2]: uint64_t(-1);
+            dmin = y == uint64_t(-1) ? std::numeric_limits<double>::infinity(): double(at(x, y));
+            std::fill(thread_best.begin(), thread_best.end(), std::make_pair(std::numeric_limits<double>::infinity(), uint64_t(-1)));
+            auto search = [&](size_t b, size_t e, unsigned tid) {
+                auto tb = thread_best[tid];
+                for(size_t p = b; p < e; ++p) {
+                    const uint64_t i = active[p];
+                    if(i == x) continue;
+                    const double d = at(x, i);
+                    if(d < tb.first || (d == tb.first && i < tb.second)) tb = std::make_pair(d, i);
+                }
+                if(tb < thread_best[tid]) thread_best[tid] = tb;
+            };
+            if(active.size() < LINKAGE_PARALLEL_MIN) search(0, active.size(), 0);
+            else ex.for_each_range(active.size(), std::max(size_t(1024), ex.default_grain(active.size())), search);
+            const auto tb = *std::min_element(thread_best.begin(), thread_best.end());
+            if(tb.first < dmin || y == uint64_t(-1)) dmin = tb.first, y = tb.second;
+            if(y == uint64_t(-1)) { // Only NaNs left; merge with anything.
+                y = active[active[0] == x];
+                dmin = at(x, y);
+            }
+            if(chain.size() >= 2 && y == chain[chain.size() - 2]) break;
+            chain.push_back(y);
+        }
+        chain.pop_back();
+        chain.pop_back();
+        if(x > y) std::swap(x, y);
+        ret.push_back(Merge{x, y, dmin});
+        const double nx = csize[x], ny = csize[y];
+        deactivate(x);
+        auto update = [&](size_t b, size_t e, unsigned) {
+            for(size_t p = b; p < e; ++p) {
+                const uint64_t k = active[p];
+                if(k == y) continue;
+                T &dky = at(k, y);
+                dky = static_cast<T>(lance_williams(method, at(k, x), dky, dmin, nx, ny, csize[k]));
+            }
+        };
+        if(active.size() < LINKAGE_PARALLEL_MIN) update(0, active.size(), 0);
+        else ex.for_each_range(active.size(), std::max(size_t(1024), ex.default_grain(active.size())), update);
+        csize[y] += csize[x];
+    }
+    return ret;
+}
+} // namespace detail
+
+/* *
+ * Agglomerative hierarchical clustering.
+ * Single linkage is computed from minimum_spanning_tree; the other methods run the
+ * nearest-neighbor chain algorithm, which needs a scratch copy of the matrix.
+ * linkage_inplace uses mat itself as that scratch space, overwriting it with inter-cluster distances.
+ * Intermediate distances are stored as T, so use a floating-point matrix for AVERAGE and WARD.
+*/
+template<typename T, size_t defv>
+LinkageMatrix linkage(const DistanceMatrix<T, defv> &mat, LinkageMethod method=LinkageMethod::AVERAGE, Executor &ex=default_executor());
+template<typename T, size_t defv>
+LinkageMatrix linkage_inplace(DistanceMatrix<T, defv> &mat, LinkageMethod method=LinkageMethod::AVERAGE, Executor &ex=default_executor()) {
+    if(method == LinkageMethod::SINGLE) return linkage(static_cast<const DistanceMatrix<T, defv> &>(mat), method, ex);
+    auto merges = detail::nn_chain(mat, method, ex);
+    return detail::linkage_from_merges(mat.size(), merges);
+}
+template<typename T, size_t defv>
+LinkageMatrix linkage(const DistanceMatrix<T, defv> &mat, LinkageMethod method, Executor &ex) {
+    if(method == LinkageMethod::SINGLE) {
+        std::vector<detail::Merge> merges;
+        merges.reserve(mat.size());
+        for(const auto &e: minimum_spanning_tree(mat, ex)) merges.push_back(detail::Merge{e.i, e.j, double(e.dist)});
+        return detail::linkage_from_merges(mat.size(), merges);
+    }
+    DistanceMatrix<T, defv> copy(mat);
+    return linkage_inplace(copy, method, ex);
+}
+
+/* *
+ * Tree is a rooted or unrooted phylogeny: nodes [0, nleaves) are the leaves (the matrix's points),
+ * and every other node lists its children. branch_length is the length of the edge to the parent.
+*/
+struct Tree {
+    struct Node {
+        std::vector<uint64_t> children;
+        double branch_length = 0.;
+    };
+    std::vector<Node> nodes;
+    uint64_t root = 0;
+    size_t nleaves = 0;
+    // Newick text, labelling leaves with labels if given and by index otherwise. Iterative, so deep trees are fine.
+    std::string newick(const std::vector<std::string> *labels=nullptr, int precision=6) const {
+        if(labels && labels->size() != nleaves) throw std::invalid_argument("Need one label per leaf");
+        std::string ret;
+        if(nodes.empty()) return ret + ';';
+        char buf[64];
+        // Stack entries: (node, index of next child to emit).
+        std::vector<std::pair<uint64_t, size_t>> stack{{root, 0}};
+        while(!stack.empty()) {
+            auto &top = stack.back();
+            const Node &node = nodes[top.first];
+            if(node.children.empty()) {
+                ret += labels ? (*labels)[top.first]: std::to_string(top.first);
+            } else if(top.second < node.children.size()) {
+                ret += top.second ? ',': '(';
+                stack.emplace_back(node.children[top.second++], 0);
+                continue;
+            } else {
+                ret += ')';
+            }
+            if(top.first != root) {
+                std::snprintf(buf, sizeof(buf), ":%.*g", precision, node.branch_length);
+                ret += buf;
+            }
+            stack.pop_back();
+        }
+        return ret + ';';
+    }
+};
+
+namespace detail {
+/*
+ * Neighbor joining over mat's storage, which is overwritten.
+ * Row sums are maintained incrementally. For the Q minimum search, each row i has the lower bound
+ * (m - 2) * rowmin_i - r_i - max_k r_k, where rowmin_i never exceeds the smallest distance in row i;
+ * rows whose bound cannot beat the best Q found so far (shared between threads) are skipped entirely.
+ */
+template<typename T, size_t defv>
+Tree neighbor_joining_impl(DistanceMatrix<T, defv> &mat, Executor &ex) {
+    const size_t n = mat.size();
+    Tree tree;
+    tree.nleaves = n;
+    tree.nodes.resize(n);
+    if(n < 2) return tree;
+    const auto offsets = mat.row_offsets();
+    T *const data = mat.data();
+    auto at = [&](size_t i, size_t j) -> T & {return i < j ? data[offsets[i] + j - i - 1]: data[offsets[j] + i - j - 1];};
+    std::vector<double> r, rowmin(n);
+    {
+        auto stats = point_stats(mat, ex);
+        r = std::move(stats.sum);
+        std::copy(stats.min.begin(), stats.min.end(), rowmin.begin());
+    }
+    std::vector<uint64_t> active(n), node_of(n);
+    for(size_t i = 0; i < n; ++i) active[i] = node_of[i] = i;
+    auto new_node = [&](uint64_t a, double la, uint64_t b, double lb) {
+        tree.nodes[a].branch_length = la;
+        tree.nodes[b].branch_length = lb;
+        tree.nodes.emplace_back();
+        tree.nodes.back().children = {a, b};
+        return uint64_t(tree.nodes.size() - 1);
+    };
+    struct Best {
+        double q;
+        uint64_t pi, pj;
+        bool operator<(const Best &o) const {return q < o.q || (q == o.q && (pi < o.pi || (pi == o.pi && pj < o.pj)));}
+    };
+    const unsigned nt = ex.concurrency();
+    std::vector<Best> thread_best(nt);
+    std::vector<double> ractive(n);
+    for(size_t m = n; m > 3; --m) {
+        // ractive is r by position in active, so the inner loop reads it contiguously.
+        for(size_t p = 0; p < m; ++p) ractive[p] = r[active[p]];
+        const double rmax = *std::max_element(ractive.begin(), ractive.begin() + m), mm2 = m - 2;
+        std::atomic<double> global_best(std::numeric_limits<double>::infinity());
+        std::fill(thread_best.begin(), thread_best.end(), Best{std::numeric_limits<double>::infinity(), 0, 0});
+        auto search = [&](size_t b, size_t e, unsigned tid) {
+            Best tb = thread_best[tid];
+            for(size_t pi = b; pi < e; ++pi) {
+                const uint64_t i = active[pi];
+                if(mm2 * rowmin[i] - ractive[pi] - rmax > global_best.load(std::memory_order_relaxed)) continue;
+                const T *rp = data + offsets[i];
+                const double ri = ractive[pi];
+                for(size_t pj = pi + 1; pj < m; ++pj) {
+                    const double q = mm2 * rp[active[pj] - i - 1] - ri - ractive[pj];
+                    if(q < tb.q) tb = Best{q, pi, pj};
+                }
+                double g = global_best.load(std::memory_order_relaxed);
+                while(tb.q < g && !global_best.compare_exchange_weak(g, tb.q, std::memory_order_relaxed));
+            }
+            if(tb < thread_best[tid]) thread_best[tid] = tb;
+        };
+        if(m < 512) search(0, m - 1, 0);
+        else ex.for_each_range(m - 1, 1, search);
+        Best best = *std::min_element(thread_best.begin(), thread_best.end());
+        if(best.pi == best.pj) best.pi = 0, best.pj = 1; // Only NaNs: join anything.
+        // active is sorted, so i < j.
+        const uint64_t i = active[best.pi], j = active[best.pj];
+        const double dij = at(i, j);
+        const double li = .5 * dij + (r[i] - r[j]) / (2. * mm2), lj = dij - li;
+        node_of[i] = new_node(node_of[i], li, node_of[j], lj);
+        active.erase(active.begin() + best.pj);
+        // The joined node takes over slot i.
+        std::vector<double> thread_sum(nt), thread_min(nt, std::numeric_limits<double>::infinity());
+        auto update = [&](size_t b, size_t e, unsigned tid) {
+            double s = 0., mn = std::numeric_limits<double>::infinity();
+            for(size_t p = b; p < e; ++p) {
+                const uint64_t k = active[p];
+                if(k == i) continue;
+                T &dik = at(i, k);
+                const double djk = at(j, k), old_ik = dik, duk = .5 * (old_ik + djk - dij);
+                dik = static_cast<T>(duk);
+                r[k] += duk - old_ik - djk;
+                rowmin[k] = std::min(rowmin[k], duk);
+                s += duk;
+                mn = std::min(mn, duk);
+            }
+            thread_sum[tid] += s;
+            thread_min[tid] = std::min(thread_min[tid], mn);
+        };
+        if(m < 512) update(0, m - 1, 0);
+        else ex.for_each_range(m - 1, std::max(size_t(256), ex.default_grain(m - 1)), update);
+        r[i] = std::accumulate(thread_sum.begin(), thread_sum.end(), 0.);
+        rowmin[i] = *std::min_element(thread_min.begin(), thread_min.end());
+    }
+    if(active.size() == 3) {
+        const uint64_t a = active[0], b = active[1], c = active[2];
+        const double dab = at(a, b), dac = at(a, c), dbc = at(b, c);
+        tree.nodes[node_of[a]].branch_length = .5 * (dab + dac - dbc);
+        tree.nodes[node_of[b]].branch_length = .5 * (dab + dbc - dac);
+        tree.nodes[node_of[c]].branch_length = .5 * (dac + dbc - dab);
+        tree.nodes.emplace_back();
+        tree.nodes.back().children = {node_of[a], node_of[b], node_of[c]};
+    } else {
+        const double d = at(active[0], active[1]);
+        new_node(node_of[active[0]], .5 * d, node_of[active[1]], .5 * d);
+    }
+    tree.root = tree.nodes.size() - 1;
+    return tree;
+}
+} // namespace detail
+
+/* *
+ * Neighbor-joining tree (Saitou & Nei). The result is unrooted, written with a trifurcation at the root
+ * as is conventional; branch lengths are not clamped, so they may be negative.
+ * neighbor_joining_inplace uses mat as scratch space, overwriting it, instead of making a copy.
+*/
+template<typename T, size_t defv>
+Tree neighbor_joining_inplace(DistanceMatrix<T, defv> &mat, Executor &ex=default_executor()) {
+    return detail::neighbor_joining_impl(mat, ex);
+}
+template<typename T, size_t defv>
+Tree neighbor_joining(const DistanceMatrix<T, defv> &mat, Executor &ex=default_executor()) {
+    DistanceMatrix<T, defv> copy(mat);
+    return detail::neighbor_joining_impl(copy, ex);
+}
+
+namespace detail {
+// Calls func(o, d(o, c)) for every point o != c in order: earlier rows are gathered, later points read from row c.
+template<typename T, typename Func>
+INLINE void for_each_distance(const T *data, const std::vector<size_t> &offsets, size_t n, size_t c, const Func &func) {
+    for(size_t o = 0; o < c; ++o) func(o, double(data[offsets[o] + c - o - 1]));
+    const T *const row = data + offsets[c];
+    for(size_t o = c + 1; o < n; ++o) func(o, double(row[o - c - 1]));
+}
+} // namespace detail
+
+struct KMedoids {
+    std::vector<uint32_t> medoids; // Point chosen for each cluster
+    std::vector<uint32_t> labels;  // Cluster (index into medoids) of each point
+    double cost = 0.;              // Sum of distances from every point to its medoid
+    size_t swaps = 0;
+};
+
+/* *
+ * kmedoids clusters mat's points around k medoids with a greedy BUILD followed by FasterPAM swaps
+ * (Schubert & Rousseeuw 2021), reading distances straight from the condensed array.
+ * Each point caches its nearest and second-nearest medoid, so scoring a candidate against all k medoids at once
+ * costs a single O(n) scan of its distances. Candidates are scored SWAP_BATCH at a time in parallel
+ * and the best improving swap of each batch is applied. The batch size is fixed, so results do not depend on the executor.
+ * Stops once every non-medoid has been tried since the last swap, or after max_passes passes over the points.
+*/
+template<typename T, size_t defv>
+KMedoids kmedoids(const DistanceMatrix<T, defv> &mat, size_t k, size_t max_passes=100, Executor &ex=default_executor()) {
+    static constexpr size_t SWAP_BATCH = 32;
+    const size_t n = mat.size();
+    if(!k || k > n) throw std::invalid_argument("kmedoids: need 0 < k <= n");
+    if(n > std::numeric_limits<uint32_t>::max()) throw std::invalid_argument("kmedoids: too many points");
+    static constexpr double INF = std::numeric_limits<double>::infinity();
+    const auto offsets = mat.row_offsets();
+    const T *const data = mat.data();
+    auto dist = [&](size_t a, size_t b) -> double {
+        return a == b ? 0.: a < b ? data[offsets[a] + b - a - 1]: data[offsets[b] + a - b - 1];
+    };
+    KMedoids ret;
+    auto &medoids = ret.medoids;
+    std::vector<uint8_t> is_medoid(n, 0);
+    std::vector<uint32_t> nearest(n), second(n, 0);
+    std::vector<double> dnear(n, INF), dsecond(n, INF);
+    using Candidate = std::pair<double, uint64_t>;
+
+    // BUILD: start from the point with the smallest distance sum, then repeatedly add the point that lowers the cost most.
+    {
+        const auto stats = point_stats(mat, ex);
+        medoids.push_back(std::min_element(stats.sum.begin(), stats.sum.end()) - stats.sum.begin());
+    }
+    is_medoid[medoids[0]] = 1;
+    dnear[medoids[0]] = 0.;
+    detail::for_each_distance(data, offsets, n, medoids[0], [&](size_t o, double d) {dnear[o] = d;});
+    std::fill(nearest.begin(), nearest.end(), 0u);
+    while(medoids.size() < k) {
+        std::vector<Candidate> thread_best(ex.concurrency(), Candidate(-1., uint64_t(-1)));
+        parallel_for(ex, n, [&](size_t c, unsigned tid) {
+            if(is_medoid[c]) return;
+            double gain = dnear[c];
+            detail::for_each_distance(data, offsets, n, c, [&](size_t o, double d) {gain += std::max(0., dnear[o] - d);});
+            auto &tb = thread_best[tid];
+            if(gain > tb.first || (gain == tb.first && c < tb.second)) tb = Candidate(gain, c);
+        }, 16);
+        Candidate best(-1., uint64_t(-1));
+        for(const auto &tb: thread_best)
+            if(tb.first > best.first || (tb.first == best.first && tb.second < best.second)) best = tb;
+        const uint32_t slot = medoids.size(), c = best.second;
+        medoids.push_back(c);
+        is_medoid[c] = 1;
+        dnear[c] = 0., nearest[c] = slot;
+        detail::for_each_distance(data, offsets, n, c, [&](size_t o, double d) {if(d < dnear[o]) dnear[o] = d, nearest[o] = slot;});
+    }
+
+    // Nearest and second-nearest medoid of o, recomputed from scratch.
+    auto assign = [&](size_t o) {
+        double d1 = INF, d2 = INF;
+        uint32_t m1 = 0, m2 = 0;
+        for(uint32_t s = 0; s < k; ++s) {
+            const double d = dist(o, medoids[s]);
+            if(d < d1) d2 = d1, m2 = m1, d1 = d, m1 = s;
+            else if(d < d2) d2 = d, m2 = s;
+        }
+        nearest[o] = m1, dnear[o] = d1, second[o] = m2, dsecond[o] = d2;
+    };
+    parallel_for(ex, n, [&](size_t o, unsigned) {assign(o);}, 1024);
+    // removal_loss[s]: cost increase if medoid s were removed and its points moved to their second-nearest medoid.
+    std::vector<double> removal_loss(k);
+    auto update_removal_loss = [&]() {
+        std::fill(removal_loss.begin(), removal_loss.end(), 0.);
+        for(size_t o = 0; o < n; ++o) removal_loss[nearest[o]] += dsecond[o] - dnear[o];
+    };
+    update_removal_loss();
+    const double tol = 1e-12 * std::max(1., std::accumulate(dnear.begin(), dnear.end(), 0.));
+
+    // SWAP: change in cost for replacing each medoid with candidate c, O(n + k).
+    struct Swap {
+        double delta;
+        uint64_t c;
+        uint32_t slot;
+    };
+    std::vector<std::vector<double>> scratch(ex.concurrency(), std::vector<double>(k));
+    auto score = [&](size_t c, unsigned tid) {
+        auto &delta = scratch[tid];
+        std::copy(removal_loss.begin(), removal_loss.end(), delta.begin());
+        // c itself leaves its cluster to become a medoid.
+        double shared = -dnear[c];
+        delta[nearest[c]] += dnear[c] - dsecond[c];
+        detail::for_each_distance(data, offsets, n, c, [&](size_t o, double d) {
+            if(d < dnear[o]) {
+                // o moves to c whichever medoid goes, so it no longer counts towards its medoid's removal loss.
+                shared += d - dnear[o];
+                delta[nearest[o]] += dnear[o] - dsecond[o];
+            } else if(d < dsecond[o]) {
+                delta[nearest[o]] += d - dsecond[o];
+            }
+        });
+        const uint32_t slot = std::min_element(delta.begin(), delta.end()) - delta.begin();
+        return Swap{delta[slot] + shared, c, slot};
+    };
+    std::vector<uint64_t> batch;
+    std::vector<Swap> results;
+    size_t next = 0, since_swap = 0, tried = 0;
+    // With one medoid, BUILD has already picked the point with the smallest distance sum, which is optimal.
+    while(k > 1 && since_swap < n && tried < max_passes * n) {
+        batch.clear();
+        while(batch.size() < SWAP_BATCH && since_swap + batch.size() < n) {
+            if(!is_medoid[next]) batch.push_back(next);
+            else ++since_swap;
+            next = next + 1 == n ? 0: next + 1;
+        }
+        if(batch.empty()) break;
+        results.resize(batch.size());
+        parallel_for(ex, batch.size(), [&](size_t b, unsigned tid) {results[b] = score(batch[b], tid);}, 1);
+        tried += batch.size();
+        size_t best = 0;
+        for(size_t b = 1; b < results.size(); ++b)
+            if(results[b].delta < results[best].delta) best = b;
+        if(!(results[best].delta < -tol)) {
+            since_swap += batch.size();
+            continue;
+        }
+        // Apply the swap, then resume scanning just after the new medoid.
+        const Swap sw = results[best];
+        is_medoid[medoids[sw.slot]] = 0;
+        medoids[sw.slot] = sw.c;
+        is_medoid[sw.c] = 1;
+        parallel_for(ex, n, [&](size_t o, unsigned) {
+            if(nearest[o] == sw.slot || second[o] == sw.slot) {
+                assign(o);
+                return;
+            }
+            const double d = dist(o, sw.c);
+            if(d < dnear[o]) second[o] = nearest[o], dsecond[o] = dnear[o], nearest[o] = sw.slot, dnear[o] = d;
+            else if(d < dsecond[o]) second[o] = sw.slot, dsecond[o] = d;
+        }, 1024);
+        update_removal_loss();
+        ++ret.swaps;
+        since_swap = 0;
+        next = sw.c + 1 == n ? 0: sw.c + 1;
+    }
+    ret.labels = std::move(nearest);
+    ret.cost = std::accumulate(dnear.begin(), dnear.end(), 0.);
+    return ret;
+}
+
+namespace detail {
+/*
+ * Union-find safe for concurrent unite and find without locks. Roots are only ever linked below smaller roots,
+ * so a failed compare-and-swap just means another thread linked the root first, and the union is retried.
+ * find halves paths as it goes; racing halvings only ever point a node at one of its ancestors.
+ */
+class ConcurrentUnionFind {
+    std::unique_ptr<std::atomic<uint32_t>[]> parent_;
+public:
+    explicit ConcurrentUnionFind(size_t n): parent_(new std::atomic<uint32_t>[n]) {
+        for(size_t i = 0; i < n; ++i) parent_[i].store(i, std::memory_order_relaxed);
+    }
+    uint32_t find(uint32_t x) {
+        for(;;) {
+            uint32_t p = parent_[x].load(std::memory_order_relaxed);
+            if(p == x) return x;
+            const uint32_t gp = parent_[p].load(std::memory_order_relaxed);
+            if(gp != p) parent_[x].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+            x = gp;
+        }
+    }
+    void unite(uint32_t a, uint32_t b) {
+        for(;;) {
+            a = find(a), b = find(b);
+            if(a == b) return;
+            if(a < b) std::swap(a, b);
+            uint32_t expected = a;
+            if(parent_[a].compare_exchange_strong(expected, b, std::memory_order_relaxed)) return;
+        }
+    }
+};
+} // namespace detail
+
+struct DensityClusters {
+    std::vector<int32_t> labels;  // Cluster of each point, numbered in order of each cluster's smallest point; -1 for noise
+    std::vector<uint8_t> is_core; // Whether each point has at least min_pts points (itself included) within eps
+    size_t nclusters = 0;
+};
+
+/* *
+ * dbscan clusters mat's points by density (Ester et al. 1996). A point is core if at least min_pts points,
+ * itself included, lie within eps; core points within eps of each other share a cluster; other points join
+ * the cluster of their nearest core point within eps, or are noise.
+ * Neighbor counts come from one parallel scan of each point's row plus a gather of its column.
+ * Core points are then joined through a lock-free union-find while rows are scanned in parallel.
+ * Unlike the original algorithm, border points are assigned by nearest core point, so results do not depend on order.
+*/
+template<typename T, size_t defv>
+DensityClusters dbscan(const DistanceMatrix<T, defv> &mat, double eps, size_t min_pts, Executor &ex=default_executor()) {
+    const size_t n = mat.size();
+    if(n > std::numeric_limits<uint32_t>::max() / 2) throw std::invalid_argument("dbscan: too many points");
+    const auto offsets = mat.row_offsets();
+    const T *const data = mat.data();
+    DensityClusters ret;
+    ret.is_core.assign(n, 0);
+    parallel_for(ex, n, [&](size_t i, unsigned) {
+        size_t count = 1;
+        const auto span = mat.row_span(i);
+        for(size_t j = 0; j < span.second; ++j) count += double(span.first[j]) <= eps;
+        for(size_t o = 0; o < i; ++o) count += double(data[offsets[o] + i - o - 1]) <= eps;
+        ret.is_core[i] = count >= min_pts;
+    }, 16);
+    detail::ConcurrentUnionFind uf(n);
+    std::vector<std::vector<uint32_t>> scratch(ex.concurrency());
+    parallel_for(ex, n, [&](size_t i, unsigned tid) {
+        if(!ret.is_core[i]) return;
+        const auto span = mat.row_span(i);
+        auto &pos = scratch[tid];
+        pos.resize(span.second);
+        size_t cnt = 0;
+        for(size_t j = 0; j < span.second; ++j) pos[cnt] = j, cnt += double(span.first[j]) <= eps;
+        for(size_t c = 0; c < cnt; ++c)
+            if(ret.is_core[i + 1 + pos[c]]) uf.unite(i, i + 1 + pos[c]);
+    }, 16);
+    // Border points take the root of their nearest core point within eps (ties to the smaller index).
+    std::vector<int64_t> root(n, -1);
+    parallel_for(ex, n, [&](size_t i, unsigned) {
+        if(ret.is_core[i]) {
+            root[i] = uf.find(i);
+            return;
+        }
+        double best = eps;
+        int64_t nearest = -1;
+        detail::for_each_distance(data, offsets, n, i, [&](size_t o, double d) {
+            if(ret.is_core[o] && (d < best || (d == best && nearest < 0))) best = d, nearest = o;
+        });
+        if(nearest >= 0) root[i] = uf.find(nearest);
+    }, 64);
+    ret.labels.assign(n, -1);
+    std::vector<int32_t> label_of_root(n, -1);
+    for(size_t i = 0; i < n; ++i) {
+        if(root[i] < 0) continue;
+        auto &l = label_of_root[root[i]];
+        if(l < 0) l = ret.nclusters++;
+        ret.labels[i] = l;
+    }
+    return ret;
+}
+
+/* *
+ * core_distances gives each point's HDBSCAN core distance: the distance to its (min_pts - 1)th nearest other point,
+ * so that min_pts counts the point itself, as in the hdbscan package. src may be a DistanceMatrix or a DistanceMatrixReader.
+ * Replacing the distances with transforms::MutualReachability{core} (through apply_indexed) and taking
+ * minimum_spanning_tree of the result gives the HDBSCAN cluster hierarchy.
+*/
+template<typename Source>
+std::vector<double> core_distances(Source &src, size_t min_pts, Executor &ex=default_executor()) {
+    if(min_pts < 2) return std::vector<double>(src.size(), 0.);
+    const auto table = knn(src, min_pts - 1, ex);
+    std::vector<double> ret(table.n, std::numeric_limits<double>::infinity());
+    if(table.k == min_pts - 1)
+        for(size_t i = 0; i < table.n; ++i) ret[i] = table.distances(i)[table.k - 1];
+    return ret;
+}
+
+namespace detail {
+/*
+ * Eigen-decomposition of the symmetric m x m row-major matrix a by cyclic Jacobi rotations; a is destroyed.
+ * Returns the eigenvalues, with the matching eigenvectors in the columns of vecs.
+ */
+inline std::vector<double> jacobi_eigen(std::vector<double> &a, size_t m, std::vector<double> &vecs) {
+    vecs.assign(m * m, 0.);
+    for(size_t i = 0; i < m; ++i) vecs[i * m + i] = 1.;
+    for(size_t sweep = 0; sweep < 100; ++sweep) {
+        double off = 0., total = 0.;
+        for(size_t p = 0; p < m; ++p)
+            for(size_t q = 0; q < m; ++q) {
+                const double v = a[p * m + q] * a[p * m + q];
+                total += v;
+                if(p != q) off += v;
+            }
+        if(off <= 1e-30 * total) break;
+        for(size_t p = 0; p < m; ++p) {
+            for(size_t q = p + 1; q < m; ++q) {
+                const double apq = a[p * m + q];
+                if(apq == 0.) continue;
+                const double theta = (a[q * m + q] - a[p * m + p]) / (2. * apq);
+                const double t = (theta >= 0. ? 1.: -1.) / (std::abs(theta) + std::sqrt(theta * theta + 1.));
+                const double c = 1. / std::sqrt(t * t + 1.), s = t * c;
+                for(size_t k = 0; k < m; ++k) {
+                    const double akp = a[k * m + p], akq = a[k * m + q];
+                    a[k * m + p] = c * akp - s * akq, a[k * m + q] = s * akp + c * akq;
+                }
+                for(size_t k = 0; k < m; ++k) {
+                    const double apk = a[p * m + k], aqk = a[q * m + k];
+                    a[p * m + k] = c * apk - s * aqk, a[q * m + k] = s * apk + c * aqk;
+                }
+                for(size_t k = 0; k < m; ++k) {
+                    const double vkp = vecs[k * m + p], vkq = vecs[k * m + q];
+                    vecs[k * m + p] = c * vkp - s * vkq, vecs[k * m + q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+    std::vector<double> ret(m);
+    for(size_t i = 0; i < m; ++i) ret[i] = a[i * m + i];
+    return ret;
+}
+
+// Orthonormalizes the b columns of the n x b row-major x by Gram-Schmidt, run twice for stability.
+inline void orthonormalize(std::vector<double> &x, size_t n, size_t b) {
+    for(size_t pass = 0; pass < 2; ++pass) {
+        for(size_t c = 0; c < b; ++c) {
+            for(size_t prev = 0; prev < c; ++prev) {
+                double dot = 0.;
+                for(size_t i = 0; i < n; ++i) dot += x[i * b + c] * x[i * b + prev];
+                for(size_t i = 0; i < n; ++i) x[i * b + c] -= dot * x[i * b + prev];
+            }
+            double norm = 0.;
+            for(size_t i = 0; i < n; ++i) norm += x[i * b + c] * x[i * b + c];
+            // A column in the span of the previous ones (B has low rank) is left at zero.
+            const double scale = norm > 1e-200 ? 1. / std::sqrt(norm): 0.;
+            for(size_t i = 0; i < n; ++i) x[i * b + c] *= scale;
+        }
+    }
+}
+
+/*
+ * y = B x for the b columns of the n x b row-major x, where B = -1/2 J D2 J is the double-centered matrix of
+ * squared distances and r holds the row means of D2. With D2's symmetric product taken from the condensed rows,
+ * (B x)_i = -1/2 ((D2 x)_i - r_i sum(x) - r . x + mean(r) sum(x)).
+ * Each row i adds d^2 x_j to y_i and d^2 x_i to y_j; the second goes to per-thread accumulators, summed at the end.
+ */
+template<typename T, size_t defv>
+void centered_product(const DistanceMatrix<T, defv> &mat, const std::vector<double> &r, const std::vector<double> &x, size_t b,
+                      std::vector<double> &y, std::vector<std::vector<double>> &accs, Executor &ex)
+{
+    const size_t n = mat.size();
+    for(auto &acc: accs) if(!acc.empty()) std::fill(acc.begin(), acc.end(), 0.);
+    ex.for_each_range(n, 16, [&](size_t rb, size_t re, unsigned tid) {
+        auto &acc = accs[tid];
+        if(acc.empty()) acc.assign(n * b, 0.);
+        std::vector<double> yi(b);
+        for(size_t i = rb; i < re; ++i) {
+            const auto span = mat.row_span(i);
+            const double *const xi = &x[i * b];
+            std::fill(yi.begin(), yi.end(), 0.);
+            for(size_t jj = 0; jj < span.second; ++jj) {
+                const size_t j = i + 1 + jj;
+                const double d = double(span.first[jj]) * double(span.first[jj]);
+                const double *const xj = &x[j * b];
+                double *const aj = &acc[j * b];
+                for(size_t c = 0; c < b; ++c) yi[c] += d * xj[c], aj[c] += d * xi[c];
+            }
+            for(size_t c = 0; c < b; ++c) acc[i * b + c] += yi[c];
+        }
+    });
+    std::vector<double> colsum(b, 0.), rdot(b, 0.);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t c = 0; c < b; ++c) colsum[c] += x[i * b + c], rdot[c] += r[i] * x[i * b + c];
+    const double rmean = std::accumulate(r.begin(), r.end(), 0.) / n;
+    y.assign(n * b, 0.);
+    parallel_for(ex, n, [&](size_t i, unsigned) {
+        double *const yi = &y[i * b];
+        for(const auto &acc: accs)
+            if(!acc.empty()) for(size_t c = 0; c < b; ++c) yi[c] += acc[i * b + c];
+        for(size_t c = 0; c < b; ++c) yi[c] = -.5 * (yi[c] - r[i] * colsum[c] - rdot[c] + rmean * colsum[c]);
+    }, 1024);
+}
+} // namespace detail
+
+struct PCoA {
+    size_t n = 0, k = 0;
+    std::vector<double> eigenvalues;           // Largest first
+    std::vector<double> proportion_explained;  // Each eigenvalue over the trace of the centered matrix
+    std::vector<double> coordinates;           // n x k, row-major: point i's coordinates start at i * k
+    const double *point(size_t i) const {return coordinates.data() + i * k;}
+};
+
+/* *
+ * pcoa computes the top k principal coordinates (classical MDS) of mat without forming the square matrix.
+ * The double-centered squared-distance matrix B is applied implicitly: each product streams the condensed rows
+ * once for a whole block of k + oversample vectors, and the centering needs only the row means of the squared
+ * distances, which come from point_stats. Randomized subspace iteration (iterations rounds, re-orthonormalized
+ * each time) is followed by a Rayleigh-Ritz step whose small eigenproblem is solved by Jacobi rotations.
+ * Coordinates are eigenvectors scaled by the square root of their eigenvalue (0 for negative ones).
+ * Memory is O(n (k + oversample)) per thread.
+*/
+template<typename T, size_t defv>
+PCoA pcoa(const DistanceMatrix<T, defv> &mat, size_t k, size_t iterations=5, size_t oversample=10, uint64_t seed=0,
+          Executor &ex=default_executor())
+{
+    const size_t n = mat.size();
+    PCoA ret;
+    ret.n = n;
+    ret.k = k = std::min(k, n);
+    if(!k) return ret;
+    const size_t b = std::min(n, k + oversample);
+    std::vector<double> r(n);
+    {
+        const auto stats = point_stats(mat, ex);
+        for(size_t i = 0; i < n; ++i) r[i] = stats.sumsq[i] / n;
+    }
+    std::vector<std::vector<double>> accs(ex.concurrency());
+    std::vector<double> q(n * b), y;
+    std::mt19937_64 mt(seed);
+    std::normal_distribution<double> gauss;
+    for(auto &v: q) v = gauss(mt);
+    detail::orthonormalize(q, n, b);
+    for(size_t it = 0; it < iterations; ++it) {
+        detail::centered_product(mat, r, q, b, y, accs, ex);
+        std::swap(q, y);
+        detail::orthonormalize(q, n, b);
+    }
+    // Rayleigh-Ritz: eigen-decompose Q^T B Q and rotate Q by its eigenvectors.
+    detail::centered_product(mat, r, q, b, y, accs, ex);
+    std::vector<double> small(b * b, 0.), vecs;
+    for(size_t i = 0; i < n; ++i)
+        for(size_t c0 = 0; c0 < b; ++c0)
+            for(size_t c1 = 0; c1 < b; ++c1) small[c0 * b + c1] += q[i * b + c0] * y[i * b + c1];
+    for(size_t c0 = 0; c0 < b; ++c0)
+        for(size_t c1 = c0 + 1; c1 < b; ++c1)
+            small[c0 * b + c1] = small[c1 * b + c0] = .5 * (small[c0 * b + c1] + small[c1 * b + c0]);
+    const auto evals = detail::jacobi_eigen(small, b, vecs);
+    std::vector<size_t> order(b);
+    std::iota(order.begin(), order.end(), size_t(0));
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t c) {return evals[a] > evals[c];});
+    // The trace of B is n * mean(r) / 2.
+    const double trace = .5 * std::accumulate(r.begin(), r.end(), 0.);
+    ret.coordinates.assign(n * k, 0.);
+    for(size_t e = 0; e < k; ++e) {
+        const size_t src = order[e];
+        ret.eigenvalues.push_back(evals[src]);
+        ret.proportion_explained.push_back(trace > 0. ? evals[src] / trace: 0.);
+        const double scale = std::sqrt(std::max(evals[src], 0.));
+        // Fix each axis's sign so its largest-magnitude coordinate is positive.
+        double big = 0.;
+        for(size_t i = 0; i < n; ++i) {
+            double v = 0.;
+            for(size_t c = 0; c < b; ++c) v += q[i * b + c] * vecs[c * b + src];
+            ret.coordinates[i * k + e] = v * scale;
+            if(std::abs(v) > std::abs(big)) big = v;
+        }
+        if(big < 0.) for(size_t i = 0; i < n; ++i) ret.coordinates[i * k + e] = -ret.coordinates[i * k + e];
+    }
+    return ret;
+}
+
+/* *
+ * ClusterQuality scores a clustering of a matrix's points. Clusters are listed by ascending label.
+ * Silhouettes are 0 for points alone in their cluster and NaN for unlabeled points; with fewer than two
+ * clusters, the silhouettes are 0 and the summary indices are NaN.
+*/
+struct ClusterQuality {
+    std::vector<int64_t> cluster_labels;  // Label of each cluster
+    std::vector<uint64_t> sizes;
+    std::vector<uint64_t> medoids;        // Point with the smallest distance sum to the rest of its cluster
+    std::vector<double> silhouettes;      // Per point
+    double mean_silhouette = std::numeric_limits<double>::quiet_NaN();
+    // nclusters x nclusters, row-major: mean distance between points of two clusters, or between distinct points of one.
+    std::vector<double> mean_distances;
+    // Davies-Bouldin with medoids in place of centroids: scatter is the mean distance to the medoid,
+    // separation the distance between medoids. Lower is better.
+    double davies_bouldin = std::numeric_limits<double>::quiet_NaN();
+    // Smallest distance between clusters over the largest distance within one. Higher is better.
+    double dunn = std::numeric_limits<double>::quiet_NaN();
+    size_t nclusters() const {return cluster_labels.size();}
+    double mean_distance(size_t c0, size_t c1) const {return mean_distances[c0 * nclusters() + c1];}
+};
+
+/* *
+ * cluster_quality computes silhouettes, mean intra- and inter-cluster distances, and the Davies-Bouldin
+ * and Dunn indices in one parallel sweep. Each point's distances (row scan plus column gather) are summed per
+ * cluster into a thread-local array; those sums give the point's silhouette and are folded into thread-local
+ * cluster-by-cluster totals, merged at the end. Points with negative labels are left out.
+ * Extra memory is O(n + threads * nclusters^2).
+*/
+template<typename T, size_t defv, typename L>
+ClusterQuality cluster_quality(const DistanceMatrix<T, defv> &mat, const std::vector<L> &labels, Executor &ex=default_executor()) {
+    const size_t n = mat.size();
+    if(labels.size() != n) throw std::invalid_argument("cluster_quality: need one label per point");
+    const double NaN = std::numeric_limits<double>::quiet_NaN(), INF = std::numeric_limits<double>::infinity();
+    ClusterQuality ret;
+    for(const auto l: labels) if(!(l < L(0))) ret.cluster_labels.push_back(int64_t(l));
+    std::sort(ret.cluster_labels.begin(), ret.cluster_labels.end());
+    ret.cluster_labels.erase(std::unique(ret.cluster_labels.begin(), ret.cluster_labels.end()), ret.cluster_labels.end());
+    const size_t k = ret.cluster_labels.size();
+    std::vector<int64_t> cid(n, -1);
+    ret.sizes.assign(k, 0);
+    for(size_t i = 0; i < n; ++i) {
+        if(labels[i] < L(0)) continue;
+        cid[i] = std::lower_bound(ret.cluster_labels.begin(), ret.cluster_labels.end(), int64_t(labels[i])) - ret.cluster_labels.begin();
+        ++ret.sizes[cid[i]];
+    }
+    const auto offsets = mat.row_offsets();
+    const T *const data = mat.data();
+    struct Local {
+        std::vector<double> sums, pair_sums;
+        double min_inter = std::numeric_limits<double>::infinity(), max_intra = 0.;
+    };
+    std::vector<Local> locals(ex.concurrency());
+    std::vector<double> own_sum(n, 0.);
+    ret.silhouettes.assign(n, NaN);
+    parallel_for(ex, n, [&](size_t i, unsigned tid) {
+        if(cid[i] < 0) return;
+        auto &loc = locals[tid];
+        if(loc.sums.empty()) loc.sums.resize(k), loc.pair_sums.assign(k * k, 0.);
+        std::fill(loc.sums.begin(), loc.sums.end(), 0.);
+        const int64_t ci = cid[i];
+        double min_inter = loc.min_inter, max_intra = loc.max_intra;
+        detail::for_each_distance(data, offsets, n, i, [&](size_t o, double d) {
+            const int64_t co = cid[o];
+            if(co < 0) return;
+            loc.sums[co] += d;
+            if(co == ci) max_intra = std::max(max_intra, d);
+            else min_inter = std::min(min_inter, d);
+        });
+        loc.min_inter = min_inter, loc.max_intra = max_intra;
+        double *const ps = &loc.pair_sums[ci * k];
+        for(size_t c = 0; c < k; ++c) ps[c] += loc.sums[c];
+        own_sum[i] = loc.sums[ci];
+        if(k < 2 || ret.sizes[ci] == 1) {
+            ret.silhouettes[i] = 0.;
+            return;
+        }
+        const double a = loc.sums[ci] / (ret.sizes[ci] - 1);
+        double b = INF;
+        for(size_t c = 0; c < k; ++c)
+            if(int64_t(c) != ci) b = std::min(b, loc.sums[c] / ret.sizes[c]);
+        ret.silhouettes[i] = std::max(a, b) > 0. ? (b - a) / std::max(a, b): 0.;
+    }, 16);
+    std::vector<double> pair_sums(k * k, 0.);
+    double min_inter = INF, max_intra = 0.;
+    for(const auto &loc: locals) {
+        if(loc.sums.empty()) continue;
+        for(size_t c = 0; c < k * k; ++c) pair_sums[c] += loc.pair_sums[c];
+        min_inter = std::min(min_inter, loc.min_inter), max_intra = std::max(max_intra, loc.max_intra);
+    }
+    ret.mean_distances.assign(k * k, 0.);
+    for(size_t c0 = 0; c0 < k; ++c0)
+        for(size_t c1 = 0; c1 < k; ++c1) {
+            const double npairs = c0 == c1 ? double(ret.sizes[c0]) * (ret.sizes[c0] - 1): double(ret.sizes[c0]) * ret.sizes[c1];
+            ret.mean_distances[c0 * k + c1] = npairs > 0. ? pair_sums[c0 * k + c1] / npairs: 0.;
+        }
+    ret.medoids.assign(k, uint64_t(-1));
+    for(size_t i = 0; i < n; ++i) {
+        if(cid[i] < 0) continue;
+        auto &m = ret.medoids[cid[i]];
+        if(m == uint64_t(-1) || own_sum[i] < own_sum[m]) m = i;
+    }
+    if(k < 2) {
+        for(auto &s: ret.silhouettes) if(!std::isnan(s)) s = 0.;
+        return ret;
+    }
+    double total = 0.;
+    size_t nlabeled = 0;
+    for(const auto s: ret.silhouettes) if(!std::isnan(s)) total += s, ++nlabeled;
+    ret.mean_silhouette = total / nlabeled;
+    auto dist = [&](size_t a, size_t b) -> double {
+        return a == b ? 0.: a < b ? data[offsets[a] + b - a - 1]: data[offsets[b] + a - b - 1];
+    };
+    std::vector<double> scatter(k);
+    for(size_t c = 0; c < k; ++c) scatter[c] = own_sum[ret.medoids[c]] / ret.sizes[c];
+    double db = 0.;
+    for(size_t c0 = 0; c0 < k; ++c0) {
+        double worst = 0.;
+        for(size_t c1 = 0; c1 < k; ++c1) {
+            if(c0 == c1) continue;
+            const double sep = dist(ret.medoids[c0], ret.medoids[c1]);
+            worst = std::max(worst, sep > 0. ? (scatter[c0] + scatter[c1]) / sep: INF);
+        }
+        db += worst;
+    }
+    ret.davies_bouldin = db / k;
+    ret.dunn = max_intra > 0. ? min_inter / max_intra: INF;
+    return ret;
+}
+
+/* *
+ * Elementwise conversions for DistanceMatrix::apply and transform_into.
+ * Each is a small functor; the simple arithmetic ones (OneMinus, Clamp, Scale) can vectorize in apply's chunk loops,
+ * while those calling std::log or std::exp generally won't without a vector math library.
+*/
+namespace transforms {
+// Mash distance from a Jaccard estimate for k-mer size k: -ln(2J / (1 + J)) / k, capped at 1.
+struct JaccardToMash {
+    double k;
+    template<typename T> T operator()(T j) const {
+        const double v = -std::log(2. * double(j) / (1. + double(j))) / k;
+        return static_cast<T>(v < 1. ? v: 1.);
+    }
+};
+// The inverse of JaccardToMash (for uncapped distances).
+struct MashToJaccard {
+    double k;
+    template<typename T> T operator()(T d) const {
+        const double t = std::exp(-k * double(d));
+        return static_cast<T>(t / (2. - t));
+    }
+};
+// 1 - x: similarity <-> distance, and ANI (as a fraction) <-> Mash-style distance.
+struct OneMinus {
+    template<typename T> T operator()(T x) const {return static_cast<T>(1) - x;}
+};
+using AniToDistance = OneMinus;
+using DistanceToAni = OneMinus;
+struct Clamp {
+    double lo, hi;
+    template<typename T> T operator()(T x) const {
+        return x < static_cast<T>(lo) ? static_cast<T>(lo): x > static_cast<T>(hi) ? static_cast<T>(hi): x;
+    }
+};
+struct Log {
+    template<typename T> T operator()(T x) const {return static_cast<T>(std::log(double(x)));}
+};
+struct Scale {
+    double factor;
+    template<typename T> T operator()(T x) const {return static_cast<T>(double(x) * factor);}
+};
+// Conversion to To for transform_into, as in DistanceMatrix::convert.
+template<typename To>
+struct SaturatingCast {
+    double scale = 1.;
+    template<typename T> To operator()(T x) const {return detail::saturating_cast<To>(x, scale);}
+};
+/*
+ * Jaccard <-> containment of the smaller set, given each point's set size, for DistanceMatrix::apply_indexed.
+ * With J the Jaccard index of A and B, |A & B| = J(|A| + |B|) / (1 + J), and the containment is |A & B| / min(|A|, |B|).
+ */
+struct JaccardToContainment {
+    const std::vector<double> &cardinalities;
+    template<typename T> T operator()(size_t i, size_t j, T jac) const {
+        const double ci = cardinalities[i], cj = cardinalities[j];
+        return static_cast<T>(double(jac) * (ci + cj) / (1. + double(jac)) / std::min(ci, cj));
+    }
+};
+struct ContainmentToJaccard {
+    const std::vector<double> &cardinalities;
+    template<typename T> T operator()(size_t i, size_t j, T c) const {
+        const double ci = cardinalities[i], cj = cardinalities[j], inter = double(c) * std::min(ci, cj);
+        return static_cast<T>(inter / (ci + cj - inter));
+    }
+};
+// max(d, core[i], core[j]): HDBSCAN's mutual reachability distance, given core_distances.
+struct MutualReachability {
+    const std::vector<double> &core;
+    template<typename T> T operator()(size_t i, size_t j, T d) const {
+        return static_cast<T>(std::max(double(d), std::max(core[i], core[j])));
+    }
+};
+} // namespace transforms
 
 template<typename T>
 struct is_distance_matrix: public std::false_type {};
@@ -0,0 +1,412 @@
+#include "distmat.h"
+#include <iostream>
+#include <random>
+
+template<typename T>
+dm::DistanceMatrix<T> make_matrix(size_t n, uint64_t seed) {
+    dm::DistanceMatrix<T> mat(n);
+    std::mt19937_64 mt(seed);
+    std::uniform_real_distribution<double> urd(0., 100.);
+    for(auto &x: mat) x = T(urd(mt));
+    return mat;
+}
+
+// Textbook O(n^3) agglomeration, for reference.
+dm::LinkageMatrix naive_linkage(dm::DistanceMatrix<double> mat, dm::LinkageMethod method) {
+    const size_t n = mat.size();
+    std::vector<bool> active(n, true);
+    std::vector<double> csize(n, 1);
+    std::vector<dm::detail::Merge> merges;
+    for(size_t step = 0; step + 1 < n; ++step) {
+        double best = std::numeric_limits<double>::infinity();
+        size_t bx = 0, by = 0;
+        for(size_t i = 0; i < n; ++i)
+            for(size_t j = i + 1; j < n; ++j)
+                if(active[i] && active[j] && mat(i, j) < best) best = mat(i, j), bx = i, by = j;
+        merges.push_back(dm::detail::Merge{bx, by, best});
+        active[bx] = false;
+        for(size_t k = 0; k < n; ++k)
+            if(active[k] && k != by)
+                mat(k, by) = dm::detail::lance_williams(method, mat(k, bx), mat(k, by), best, csize[bx], csize[by], csize[k]);
+        csize[by] += csize[bx];
+    }
+    return dm::detail::linkage_from_merges(n, merges);
+}
+
+void check_linkage(const dm::LinkageMatrix &a, const dm::LinkageMatrix &b) {
+    assert(a.n == b.n && a.z.size() == b.z.size());
+    for(size_t i = 0; i < a.z.size(); ++i)
+        assert(std::abs(a.z[i] - b.z[i]) <= 1e-9 * std::max(1., std::abs(a.z[i])));
+}
+
+void test_linkage(dm::Executor &ex, size_t n) {
+    auto mat = make_matrix<double>(n, n);
+    for(const auto method: {dm::LinkageMethod::SINGLE, dm::LinkageMethod::COMPLETE, dm::LinkageMethod::AVERAGE,
+                            dm::LinkageMethod::WEIGHTED, dm::LinkageMethod::WARD}) {
+        const auto expected = naive_linkage(mat, method);
+        check_linkage(dm::linkage(mat, method, ex), expected);
+        auto copy = mat;
+        check_linkage(dm::linkage_inplace(copy, method, ex), expected);
+    }
+}
+
+// Distances between all leaves of tree along its edges.
+dm::DistanceMatrix<double> patristic(const dm::Tree &tree) {
+    const size_t nn = tree.nodes.size();
+    std::vector<std::vector<std::pair<size_t, double>>> adj(nn);
+    for(size_t v = 0; v < nn; ++v)
+        for(const auto c: tree.nodes[v].children)
+            adj[v].emplace_back(c, tree.nodes[c].branch_length), adj[c].emplace_back(v, tree.nodes[c].branch_length);
+    dm::DistanceMatrix<double> ret(tree.nleaves);
+    for(size_t leaf = 0; leaf < tree.nleaves; ++leaf) {
+        std::vector<double> dist(nn, -1.);
+        std::vector<size_t> stack{leaf};
+        dist[leaf] = 0.;
+        while(!stack.empty()) {
+            const size_t v = stack.back();
+            stack.pop_back();
+            for(const auto &e: adj[v])
+                if(dist[e.first] < 0.) dist[e.first] = dist[v] + e.second, stack.push_back(e.first);
+        }
+        for(size_t j = leaf + 1; j < tree.nleaves; ++j) ret(leaf, j) = dist[j];
+    }
+    return ret;
+}
+
+void test_nj(dm::Executor &ex, size_t n) {
+    // A random additive metric: NJ must recover it exactly.
+    std::mt19937_64 mt(n);
+    std::uniform_real_distribution<double> urd(0.1, 1.);
+    dm::Tree truth;
+    truth.nleaves = n;
+    truth.nodes.resize(n);
+    std::vector<uint64_t> roots(n);
+    for(size_t i = 0; i < n; ++i) roots[i] = i, truth.nodes[i].branch_length = urd(mt);
+    while(roots.size() > 1) {
+        const size_t a = mt() % roots.size();
+        std::swap(roots[a], roots.back());
+        const size_t b = mt() % (roots.size() - 1);
+        truth.nodes.emplace_back();
+        truth.nodes.back().children = {roots.back(), roots[b]};
+        truth.nodes.back().branch_length = urd(mt);
+        roots.pop_back();
+        roots[b] = truth.nodes.size() - 1;
+    }
+    truth.root = roots[0];
+    const auto mat = patristic(truth);
+    const auto tree = dm::neighbor_joining(mat, ex);
+    assert(tree.nleaves == n);
+    const auto got = patristic(tree);
+    for(size_t i = 0; i < mat.num_entries(); ++i)
+        assert(std::abs(mat.data()[i] - got.data()[i]) < 1e-6);
+    std::vector<std::string> labels;
+    for(size_t i = 0; i < n; ++i) labels.push_back("taxon" + std::to_string(i));
+    const auto nwk = tree.newick(&labels);
+    assert(nwk.back() == ';' && std::count(nwk.begin(), nwk.end(), '(') == std::count(nwk.begin(), nwk.end(), ')'));
+    for(const auto &l: labels) assert(nwk.find(l + ":") != std::string::npos);
+}
+
+void test_mst(dm::Executor &ex, size_t n) {
+    auto mat = make_matrix<float>(n, n + 1);
+    const auto mst = dm::minimum_spanning_tree(mat, ex);
+    assert(mst.size() == (n ? n - 1: 0));
+    // Compare the total weight with Kruskal's algorithm.
+    std::vector<std::tuple<float, size_t, size_t>> edges;
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i + 1; j < n; ++j)
+            edges.emplace_back(mat(i, j), i, j);
+    std::sort(edges.begin(), edges.end());
+    std::vector<size_t> parent(n);
+    std::iota(parent.begin(), parent.end(), size_t(0));
+    std::function<size_t(size_t)> find = [&](size_t x) {return parent[x] == x ? x: parent[x] = find(parent[x]);};
+    double expected = 0., got = 0.;
+    for(const auto &e: edges) {
+        const size_t a = find(std::get<1>(e)), b = find(std::get<2>(e));
+        if(a != b) parent[a] = b, expected += std::get<0>(e);
+    }
+    for(size_t i = 0; i < mst.size(); ++i) {
+        got += mst[i].dist;
+        assert(mst[i].i < mst[i].j && mst[i].dist == mat(mst[i].i, mst[i].j));
+        if(i) assert(mst[i - 1].dist <= mst[i].dist);
+    }
+    assert(std::abs(expected - got) < 1e-6 * std::max(1., expected));
+    // Clusters at each cutoff must be the connected components of the thresholded graph.
+    const std::vector<double> cutoffs{50., 0., 5., 1e9};
+    const auto all = dm::single_linkage_clusters(mat, cutoffs, ex);
+    for(size_t ci = 0; ci < cutoffs.size(); ++ci) {
+        std::vector<int64_t> comp(n, -1);
+        int64_t ncomp = 0;
+        for(size_t s = 0; s < n; ++s) {
+            if(comp[s] >= 0) continue;
+            std::vector<size_t> stack{s};
+            comp[s] = ncomp;
+            while(!stack.empty()) {
+                const size_t v = stack.back();
+                stack.pop_back();
+                for(size_t j = 0; j < n; ++j)
+                    if(j != v && comp[j] < 0 && mat(v, j) <= cutoffs[ci]) comp[j] = ncomp, stack.push_back(j);
+            }
+            ++ncomp;
+        }
+        for(size_t i = 0; i < n; ++i) assert(all[ci][i] == uint32_t(comp[i]));
+        assert(dm::single_linkage_clusters(mst, n, cutoffs[ci]) == all[ci]);
+    }
+}
+
+double medoid_cost(const dm::DistanceMatrix<float> &mat, const std::vector<uint32_t> &medoids) {
+    double cost = 0.;
+    for(size_t o = 0; o < mat.size(); ++o) {
+        double best = std::numeric_limits<double>::infinity();
+        for(const auto m: medoids) best = std::min(best, m == o ? 0.: double(mat(o, m)));
+        cost += best;
+    }
+    return cost;
+}
+
+// Points on a line in tight groups, so the optimal medoids are the group centres.
+dm::DistanceMatrix<float> clustered_points(size_t n, size_t ngroups, std::vector<size_t> &group) {
+    std::mt19937_64 mt(n);
+    std::vector<double> x(n);
+    group.resize(n);
+    for(size_t i = 0; i < n; ++i) group[i] = mt() % ngroups, x[i] = 100. * group[i] + double(mt() % 1000) / 1000.;
+    dm::DistanceMatrix<float> mat(n);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i + 1; j < n; ++j) mat(i, j) = std::abs(x[i] - x[j]);
+    return mat;
+}
+
+void test_kmedoids(dm::Executor &ex, size_t n) {
+    const auto mat = make_matrix<float>(n, 3);
+    for(const size_t k: {size_t(1), size_t(2), size_t(5), n}) {
+        if(k > n) continue;
+        const auto res = dm::kmedoids(mat, k, 100, ex);
+        assert(res.medoids.size() == k && res.labels.size() == n);
+        std::vector<uint32_t> sorted(res.medoids);
+        std::sort(sorted.begin(), sorted.end());
+        assert(std::unique(sorted.begin(), sorted.end()) == sorted.end());
+        assert(std::abs(res.cost - medoid_cost(mat, res.medoids)) < 1e-6 * std::max(1., res.cost));
+        for(size_t o = 0; o < n; ++o) {
+            const auto m = res.medoids[res.labels[o]];
+            const double d = m == o ? 0.: mat(o, m);
+            for(const auto other: res.medoids) assert(d <= (other == o ? 0.: mat(o, other)));
+        }
+        // FasterPAM stops at a local optimum: no single swap improves the cost.
+        if(n <= 60) {
+            for(size_t s = 0; s < k; ++s) {
+                for(uint32_t c = 0; c < n; ++c) {
+                    if(std::find(res.medoids.begin(), res.medoids.end(), c) != res.medoids.end()) continue;
+                    auto swapped = res.medoids;
+                    swapped[s] = c;
+                    assert(medoid_cost(mat, swapped) >= res.cost - 1e-6 * std::max(1., res.cost));
+                }
+            }
+        }
+    }
+    std::vector<size_t> group;
+    const auto pts = clustered_points(n, 4, group);
+    if(n >= 40) {
+        const auto res = dm::kmedoids(pts, 4, 100, ex);
+        for(size_t i = 0; i < n; ++i)
+            for(size_t j = 0; j < n; ++j)
+                assert((group[i] == group[j]) == (res.labels[i] == res.labels[j]));
+    }
+}
+
+// DBSCAN by breadth-first search over core points, with border points given to their nearest core point.
+std::vector<int32_t> naive_dbscan(const dm::DistanceMatrix<float> &mat, double eps, size_t min_pts) {
+    const size_t n = mat.size();
+    auto d = [&](size_t i, size_t j) {return i == j ? 0.: double(mat(i, j));};
+    std::vector<uint8_t> core(n);
+    for(size_t i = 0; i < n; ++i) {
+        size_t c = 0;
+        for(size_t j = 0; j < n; ++j) c += d(i, j) <= eps;
+        core[i] = c >= min_pts;
+    }
+    std::vector<int64_t> comp(n, -1);
+    for(size_t s = 0; s < n; ++s) {
+        if(!core[s] || comp[s] >= 0) continue;
+        std::vector<size_t> stack{s};
+        comp[s] = s;
+        while(!stack.empty()) {
+            const size_t v = stack.back();
+            stack.pop_back();
+            for(size_t w = 0; w < n; ++w)
+                if(core[w] && comp[w] < 0 && d(v, w) <= eps) comp[w] = s, stack.push_back(w);
+        }
+    }
+    for(size_t i = 0; i < n; ++i) {
+        if(core[i]) continue;
+        double best = std::numeric_limits<double>::infinity();
+        for(size_t j = 0; j < n; ++j)
+            if(core[j] && d(i, j) <= eps && d(i, j) < best) best = d(i, j), comp[i] = comp[j];
+    }
+    std::vector<int32_t> labels(n, -1);
+    std::map<int64_t, int32_t> ids;
+    for(size_t i = 0; i < n; ++i)
+        if(comp[i] >= 0) labels[i] = ids.emplace(comp[i], int32_t(ids.size())).first->second;
+    return labels;
+}
+
+void test_dbscan(dm::Executor &ex, size_t n) {
+    std::vector<size_t> group;
+    auto mat = clustered_points(n, 5, group);
+    // Spread some points out so there are border and noise points as well.
+    std::mt19937_64 mt(n);
+    for(size_t i = 0; i < n; ++i)
+        if(mt() % 8 == 0)
+            for(size_t j = 0; j < n; ++j) if(j != i) mat(i, j) += 0.5 + double(mt() % 100) / 100.;
+    for(const double eps: {0.05, 0.6, 1.2})
+        for(const size_t min_pts: {size_t(1), size_t(3), size_t(10)}) {
+            const auto res = dm::dbscan(mat, eps, min_pts, ex);
+            assert(res.labels == naive_dbscan(mat, eps, min_pts));
+            assert(n == 0 || size_t(*std::max_element(res.labels.begin(), res.labels.end()) + 1) == res.nclusters);
+        }
+    for(const size_t min_pts: {1u, 2u, 6u}) {
+        const auto core = dm::core_distances(mat, min_pts, ex);
+        for(size_t i = 0; i < n; ++i) {
+            std::vector<double> row{0.};
+            for(size_t j = 0; j < n; ++j) if(j != i) row.push_back(mat(i, j));
+            std::sort(row.begin(), row.end());
+            assert(core[i] == (min_pts <= row.size() ? row[min_pts - 1]: std::numeric_limits<double>::infinity()));
+        }
+        auto mreach = mat;
+        mreach.apply_indexed(dm::transforms::MutualReachability{core}, ex);
+        for(size_t i = 0; i < n; ++i)
+            for(size_t j = i + 1; j < n; ++j)
+                assert(mreach(i, j) == float(std::max<double>(mat(i, j), std::max(core[i], core[j]))));
+    }
+}
+
+void test_quality(dm::Executor &ex, size_t n, size_t nlabels) {
+    const auto mat = make_matrix<float>(n, 11);
+    std::mt19937_64 mt(n + nlabels);
+    std::vector<int32_t> labels(n);
+    // Labels are sparse and include unlabeled (-1) points.
+    for(auto &l: labels) l = mt() % 7 == 0 ? -1: int32_t(mt() % nlabels) * 3;
+    const auto q = dm::cluster_quality(mat, labels, ex);
+    auto d = [&](size_t i, size_t j) {return i == j ? 0.: double(mat(i, j));};
+    std::vector<int64_t> ids;
+    for(const auto l: labels) if(l >= 0) ids.push_back(l);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    assert(q.cluster_labels == ids);
+    const size_t k = ids.size();
+    auto members = [&](size_t c) {
+        std::vector<size_t> ret;
+        for(size_t i = 0; i < n; ++i) if(labels[i] == ids[c]) ret.push_back(i);
+        return ret;
+    };
+    auto close = [](double a, double b) {return std::abs(a - b) <= 1e-9 * std::max(1., std::abs(b));};
+    double min_inter = std::numeric_limits<double>::infinity(), max_intra = 0., total = 0.;
+    size_t nlabeled = 0;
+    for(size_t c0 = 0; c0 < k; ++c0) {
+        const auto m0 = members(c0);
+        assert(q.sizes[c0] == m0.size());
+        for(size_t c1 = 0; c1 < k; ++c1) {
+            const auto m1 = members(c1);
+            double s = 0., npairs = 0.;
+            for(const auto i: m0) for(const auto j: m1) if(i != j) s += d(i, j), ++npairs;
+            assert(close(q.mean_distance(c0, c1), npairs ? s / npairs: 0.));
+        }
+        double best = std::numeric_limits<double>::infinity();
+        for(const auto i: m0) {
+            double s = 0.;
+            for(const auto j: m0) s += d(i, j);
+            if(s < best) best = s;
+            // Silhouette of i.
+            if(k < 2 || m0.size() == 1) {
+                assert(q.silhouettes[i] == 0.);
+            } else {
+                const double a = s / (m0.size() - 1);
+                double b = std::numeric_limits<double>::infinity();
+                for(size_t c1 = 0; c1 < k; ++c1) {
+                    if(c1 == c0) continue;
+                    const auto m1 = members(c1);
+                    double t = 0.;
+                    for(const auto j: m1) t += d(i, j);
+                    b = std::min(b, t / m1.size());
+                }
+                assert(close(q.silhouettes[i], (b - a) / std::max(a, b)));
+            }
+            total += q.silhouettes[i], ++nlabeled;
+            for(size_t j = 0; j < n; ++j) {
+                if(j == i || labels[j] < 0) continue;
+                if(labels[j] == labels[i]) max_intra = std::max(max_intra, d(i, j));
+                else min_inter = std::min(min_inter, d(i, j));
+            }
+        }
+        double ms = 0.;
+        for(const auto j: m0) ms += d(q.medoids[c0], j);
+        assert(ms == best && labels[q.medoids[c0]] == ids[c0]);
+    }
+    for(size_t i = 0; i < n; ++i) if(labels[i] < 0) assert(std::isnan(q.silhouettes[i]));
+    if(k < 2) {
+        assert(std::isnan(q.mean_silhouette) && std::isnan(q.dunn) && std::isnan(q.davies_bouldin));
+        return;
+    }
+    assert(close(q.mean_silhouette, total / nlabeled));
+    assert(max_intra > 0. ? close(q.dunn, min_inter / max_intra): std::isinf(q.dunn));
+    double db = 0.;
+    for(size_t c0 = 0; c0 < k; ++c0) {
+        double worst = 0.;
+        for(size_t c1 = 0; c1 < k; ++c1) {
+            if(c0 == c1) continue;
+            double s0 = 0., s1 = 0.;
+            for(const auto j: members(c0)) s0 += d(q.medoids[c0], j);
+            for(const auto j: members(c1)) s1 += d(q.medoids[c1], j);
+            worst = std::max(worst, (s0 / q.sizes[c0] + s1 / q.sizes[c1]) / d(q.medoids[c0], q.medoids[c1]));
+        }
+        db += worst;
+    }
+    assert(close(q.davies_bouldin, db / k));
+}
+
+int main() {
+    dm::ThreadPool pool(4);
+    dm::SerialExecutor serial;
+    for(const size_t n: {1u, 2u, 3u, 17u, 120u}) {
+        test_linkage(pool, n);
+        test_linkage(serial, n);
+    }
+    for(const size_t n: {0u, 1u, 2u, 40u, 300u}) {
+        test_mst(pool, n);
+        test_mst(serial, n);
+    }
+    for(const size_t n: {2u, 3u, 4u, 30u, 700u}) {
+        test_nj(pool, n);
+        test_nj(serial, n);
+    }
+    assert(dm::neighbor_joining(dm::DistanceMatrix<float>(1)).newick() == "0;");
+    for(const size_t n: {0u, 1u, 2u, 30u, 500u}) {
+        test_dbscan(pool, n);
+        test_dbscan(serial, n);
+    }
+    for(const size_t n: {0u, 1u, 3u, 40u, 150u})
+        for(const size_t nlabels: {1u, 2u, 6u, 30u}) {
+            test_quality(pool, n, nlabels);
+            test_quality(serial, n, nlabels);
+        }
+    {
+        // Well-separated clusters score well; k-medoids labels (unsigned) are accepted as they are.
+        std::vector<size_t> group;
+        const auto pts = clustered_points(300, 4, group);
+        const auto q = dm::cluster_quality(pts, dm::kmedoids(pts, 4, 100, pool).labels, pool);
+        assert(q.nclusters() == 4 && q.mean_silhouette > 0.9 && q.dunn > 10. && q.davies_bouldin < 0.1);
+    }
+    for(const size_t n: {1u, 2u, 9u, 60u, 400u}) {
+        test_kmedoids(pool, n);
+        test_kmedoids(serial, n);
+    }
+    {
+        // Large enough for the parallel paths; they must agree with the serial ones.
+        auto mat = make_matrix<float>(4500, 7);
+        for(const auto method: {dm::LinkageMethod::SINGLE, dm::LinkageMethod::AVERAGE})
+            check_linkage(dm::linkage(mat, method, pool), dm::linkage(mat, method, serial));
+        const auto mst = dm::minimum_spanning_tree(mat, pool), smst = dm::minimum_spanning_tree(mat, serial);
+        for(size_t i = 0; i < mst.size(); ++i)
+            assert(mst[i].i == smst[i].i && mst[i].j == smst[i].j && mst[i].dist == smst[i].dist);
+        const auto km = dm::kmedoids(mat, 20, 100, pool), skm = dm::kmedoids(mat, 20, 100, serial);
+        assert(km.medoids == skm.medoids && km.labels == skm.labels && km.swaps == skm.swaps);
+    }
+    std::fprintf(stderr, "Passed clustering tests\n");
+}
@@ -0,0 +1,107 @@
+#include "distmat.h"
+#include <iostream>
+#include <random>
+
+template<typename T>
+void test_fill(dm::Executor &ex, const size_t n, size_t bs) {
+    dm::DistanceMatrix<T> mat(n);
+    dm::parallel_fill(mat, n, [](uint64_t x, uint64_t y) {return T(x * 3 + y);}, bs, ex);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i + 1; j < n; ++j)
+            assert(mat(i, j) == T(j * 3 + i));
+}
+
+void test_ranges(dm::Executor &ex, size_t n, size_t grain) {
+    std::vector<std::atomic<int>> seen(n);
+    std::vector<std::atomic<int>> tids(ex.concurrency());
+    ex.for_each_range(n, grain, [&](size_t b, size_t e, unsigned tid) {
+        assert(tid < ex.concurrency());
+        ++tids[tid];
+        for(size_t i = b; i < e; ++i) ++seen[i];
+    });
+    for(auto &x: seen) assert(x == 1);
+    int flag = 0;
+    auto fut = ex.async([&]() {flag = 7;});
+    fut.get();
+    assert(flag == 7);
+}
+
+void test_all(dm::Executor &ex) {
+    for(const size_t n: {0u, 1u, 17u, 1000u}) {
+        test_ranges(ex, n, 0);
+        test_ranges(ex, n, 3);
+    }
+    for(const size_t n: {2u, 3u, 280u}) {
+        test_fill<double>(ex, n, 1);
+        test_fill<float>(ex, n, 4);
+        test_fill<uint32_t>(ex, n, 40);
+    }
+    // Nested parallelism must not deadlock.
+    std::atomic<size_t> total(0);
+    dm::parallel_for(ex, 8, [&](size_t, unsigned) {
+        dm::parallel_for(ex, 100, [&](size_t, unsigned) {++total;});
+    });
+    assert(total == 800);
+    bool caught = false;
+    try {
+        dm::parallel_for(ex, 100, [](size_t i, unsigned) {if(i == 50) throw std::runtime_error("expected");});
+    } catch(const std::runtime_error &) {caught = true;}
+    assert(caught);
+}
+
+void test_instrumentation(dm::Executor &ex) {
+    const size_t n = 300;
+    size_t ncalls = 0;
+    dm::Instrumentation ins([&](const dm::Instrumentation &) {++ncalls;}, std::chrono::milliseconds(0));
+    dm::DistanceMatrix<float> mat(n);
+    dm::parallel_fill(mat, n, [](uint64_t x, uint64_t y) {return float(x + y);}, 7, ex, &ins);
+    assert(ins.counters.pairs_computed == mat.num_entries());
+    assert(ins.counters.pairs_total == mat.num_entries());
+    assert(ins.nthreads() == ex.concurrency());
+    assert(ncalls > 0);
+    mat.write("instrumented.dm.gz", 3, &ins);
+    assert(ins.counters.bytes_uncompressed == mat.num_entries() * sizeof(float));
+    assert(ins.counters.bytes_written > 0 && ins.counters.bytes_written < ins.counters.bytes_uncompressed);
+    dm::Instrumentation rins;
+    dm::DistanceMatrix<float> mat2;
+    mat2.read("instrumented.dm.gz", nullptr, false, &rins);
+    assert(mat2 == mat);
+    assert(rins.counters.bytes_uncompressed == mat.num_entries() * sizeof(float));
+    std::remove("instrumented.dm.gz");
+}
+
+void test_pinning() {
+    dm::ThreadPool pinned(3, {0});
+    test_all(pinned);
+#ifdef __linux__
+    // A failed pin must surface as an exception, with the workers already started joined.
+    for(const int cpu: {-1, int(CPU_SETSIZE)}) {
+        bool threw = false;
+        try {
+            dm::ThreadPool bad(4, {0, cpu});
+        } catch(const std::invalid_argument &) {threw = true;}
+        assert(threw);
+    }
+#endif
+}
+
+int main() {
+    dm::SerialExecutor serial;
+    test_all(serial);
+    dm::ThreadPool pool(4);
+    test_all(pool);
+    dm::ThreadPool single(1);
+    test_all(single);
+    dm::OpenMPExecutor omp(3);
+    test_all(omp);
+    dm::ExternalExecutor ext([&pool](std::function<void()> f) {pool.enqueue(std::move(f));}, 3);
+    test_all(ext);
+    dm::set_default_executor(&serial);
+    assert(&dm::default_executor() == &serial);
+    dm::set_default_executor(nullptr);
+    test_all(dm::default_executor());
+    test_instrumentation(pool);
+    test_instrumentation(serial);
+    test_pinning();
+    std::fprintf(stderr, "Passed executor tests\n");
+}
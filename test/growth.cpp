@@ -0,0 +1,178 @@
+#include "distmat.h"
+#include <iostream>
+#include <random>
+
+static double pair_value(uint64_t x, uint64_t y) {return double(x * 1000 + y);}
+
+template<typename T>
+void test_resize(size_t n, size_t m) {
+    dm::DistanceMatrix<T> mat(n);
+    dm::parallel_fill(mat, n, [](uint64_t x, uint64_t y) {return T(pair_value(x, y));}, 4);
+    mat.resize(n + m);
+    assert(mat.size() == n + m);
+    for(size_t i = 0; i < n + m; ++i)
+        for(size_t j = i + 1; j < n + m; ++j)
+            assert(mat(i, j) == (j < n ? T(pair_value(j, i)): T(-1)));
+}
+
+template<typename T>
+void test_growable(dm::Executor &ex, const char *path) {
+    auto oracle = [](uint64_t x, uint64_t y) {return T(pair_value(x, y));};
+    if(path) std::remove(path);
+    {
+        dm::GrowableDistanceMatrix<T> mat = path ? dm::GrowableDistanceMatrix<T>(path): dm::GrowableDistanceMatrix<T>();
+        assert(mat.size() == 0);
+        for(const size_t m: {1u, 1u, 5u, 100u, 1u, 37u}) {
+            const size_t old = mat.size();
+            mat.append(m, oracle, ex);
+            assert(mat.size() == old + m);
+        }
+        for(size_t i = 0; i < mat.size(); ++i)
+            for(size_t j = i + 1; j < mat.size(); ++j)
+                assert(mat(i, j) == oracle(j, i) && mat(j, i) == oracle(j, i));
+        auto rm = mat.to_distance_matrix(ex);
+        for(size_t i = 0; i < rm.size(); ++i)
+            for(size_t j = i + 1; j < rm.size(); ++j)
+                assert(rm(i, j) == oracle(j, i));
+        dm::GrowableDistanceMatrix<T> back(rm, nullptr, ex);
+        assert(back == mat);
+        mat.write("growable.dm.gz", 6);
+        dm::GrowableDistanceMatrix<T> loaded("growable.dm.gz");
+        assert(!loaded.is_mmapped());
+        assert(loaded == mat);
+        std::remove("growable.dm.gz");
+    }
+    if(path) {
+        // Reopen the mapped file and keep growing it.
+        dm::GrowableDistanceMatrix<T> mat(path);
+        assert(mat.is_mmapped() && mat.size() == 145);
+        mat.append(10, oracle, ex);
+        for(size_t i = 0; i < mat.size(); ++i)
+            for(size_t j = i + 1; j < mat.size(); ++j)
+                assert(mat(i, j) == oracle(j, i));
+        std::remove(path);
+    }
+}
+
+template<typename T>
+void test_combine(dm::Executor &ex, size_t n, size_t m, const char *path) {
+    // Points 0..n-1 are a's, n..n+m-1 are b's; every pair has a known value.
+    auto value = [](uint64_t x, uint64_t y) {return T(pair_value(std::max(x, y), std::min(x, y)));};
+    dm::DistanceMatrix<T> a(n), b(m);
+    dm::parallel_fill(a, n, [&](uint64_t x, uint64_t y) {return value(x, y);}, 3, ex);
+    dm::parallel_fill(b, m, [&](uint64_t x, uint64_t y) {return value(n + x, n + y);}, 1, ex);
+    dm::RectDistanceMatrix<T> cross(n, m);
+    dm::Instrumentation ins;
+    dm::parallel_fill(cross, [&](uint64_t i, uint64_t j) {return value(i, n + j);}, 2, ex, &ins);
+    assert(ins.counters.pairs_computed.load() == n * m && ins.counters.pairs_total.load() == n * m);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = 0; j < m; ++j) assert(cross(i, j) == value(i, n + j));
+    if(path) std::remove(path);
+    {
+        const auto all = dm::combine(a, b, cross, path, ex);
+        assert(all.size() == n + m);
+        for(size_t i = 0; i < n + m; ++i)
+            for(size_t j = i + 1; j < n + m; ++j) assert(all(i, j) == value(i, j));
+    }
+    if(path && n + m > 1) {
+        const dm::DistanceMatrix<T> loaded(path);
+        for(size_t i = 0; i < n + m; ++i)
+            for(size_t j = i + 1; j < n + m; ++j) assert(loaded(i, j) == value(i, j));
+        bool threw = false;
+        try {
+            dm::combine(a, b, cross, path, ex);
+        } catch(const std::runtime_error &) {threw = true;}
+        assert(threw);
+    }
+    bool threw = false;
+    try {
+        dm::combine(a, b, dm::RectDistanceMatrix<T>(n + 1, m), nullptr, ex);
+    } catch(const std::invalid_argument &) {threw = true;}
+    assert(threw);
+    if(path) std::remove(path);
+}
+
+template<typename T>
+void test_rect(dm::Executor &ex, size_t nrows, size_t ncols) {
+    // Few distinct values, so that ties are exercised.
+    auto oracle = [](uint64_t i, uint64_t j) {return T((i * 7 + j * 13) % 23);};
+    const char *path = "rect.dm";
+    std::remove(path);
+    {
+        dm::RectDistanceMatrix<T> mat(path, nrows, ncols);
+        assert(mat.is_mmapped() && mat.rows() == nrows && mat.cols() == ncols);
+        dm::parallel_fill(mat, oracle, 3, ex);
+        mat.sync();
+    }
+    dm::RectDistanceMatrix<T> mat(path);
+    assert(mat.is_mmapped() && mat.rows() == nrows && mat.cols() == ncols);
+    for(size_t i = 0; i < nrows; ++i)
+        for(size_t j = 0; j < ncols; ++j) assert(mat(i, j) == oracle(i, j));
+    for(const int level: {0, 6}) {
+        mat.write("rect.dm.gz", level);
+        dm::RectDistanceMatrix<T> loaded("rect.dm.gz");
+        assert(loaded.is_mmapped() == !level);
+        assert(loaded == mat);
+        std::remove("rect.dm.gz");
+    }
+    bool threw = false;
+    try {
+        dm::RectDistanceMatrix<T> wrong(path, nrows + 1, ncols);
+    } catch(const std::runtime_error &) {threw = true;}
+    assert(threw);
+    threw = false;
+    try {
+        dm::RectDistanceMatrix<int16_t> wrong(path);
+    } catch(const std::runtime_error &) {threw = true;}
+    assert(threw);
+    const size_t k = 5;
+    for(const bool largest: {false, true}) {
+        const auto nn = dm::knn(mat, k, ex, largest);
+        assert(nn.n == nrows && nn.k == std::min(k, ncols));
+        for(size_t i = 0; i < nrows; ++i) {
+            std::vector<std::pair<double, uint64_t>> row;
+            for(size_t j = 0; j < ncols; ++j) row.emplace_back(largest ? -double(oracle(i, j)): double(oracle(i, j)), j);
+            std::sort(row.begin(), row.end());
+            for(size_t r = 0; r < nn.k; ++r)
+                assert(nn.indices(i)[r] == row[r].second && nn.distances(i)[r] == oracle(i, row[r].second));
+        }
+    }
+    for(const bool inclusive: {false, true}) {
+        const auto edges = dm::threshold_edges(mat, 9., inclusive, ex);
+        size_t e = 0;
+        for(size_t i = 0; i < nrows; ++i)
+            for(size_t j = 0; j < ncols; ++j) {
+                if(inclusive ? oracle(i, j) > 9: oracle(i, j) >= 9) continue;
+                assert(e < edges.size() && edges[e].i == i && edges[e].j == j && edges[e].dist == oracle(i, j));
+                ++e;
+            }
+        assert(e == edges.size());
+        assert(dm::count_below(mat, 9., inclusive, ex) == e);
+    }
+    const auto h = dm::histogram(mat, 23, 0., 23., ex);
+    assert(std::accumulate(h.counts.begin(), h.counts.end(), uint64_t(0)) == nrows * ncols);
+    std::remove(path);
+}
+
+int main() {
+    test_resize<float>(10, 5);
+    test_resize<uint32_t>(1, 20);
+    test_resize<double>(200, 1);
+    dm::ThreadPool pool(4);
+    dm::SerialExecutor serial;
+    test_growable<float>(pool, nullptr);
+    test_growable<double>(serial, nullptr);
+    test_growable<float>(pool, "growable.dm");
+    test_growable<uint64_t>(serial, "growable.dm");
+    for(const auto &nm: {std::make_pair(0u, 0u), std::make_pair(0u, 5u), std::make_pair(1u, 1u), std::make_pair(30u, 1u), std::make_pair(120u, 77u)}) {
+        test_combine<float>(pool, nm.first, nm.second, nullptr);
+        test_combine<double>(serial, nm.first, nm.second, "combined.dm");
+        test_combine<uint32_t>(pool, nm.first, nm.second, "combined.dm");
+    }
+    for(const auto &nm: {std::make_pair(0u, 4u), std::make_pair(1u, 1u), std::make_pair(3u, 200u), std::make_pair(150u, 60u)}) {
+        test_rect<float>(pool, nm.first, nm.second);
+        test_rect<uint16_t>(serial, nm.first, nm.second);
+        test_rect<double>(pool, nm.first, nm.second);
+    }
+    std::fprintf(stderr, "Passed growth tests\n");
+}
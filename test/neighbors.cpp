@@ -0,0 +1,146 @@
+#include "distmat.h"
+#include <iostream>
+#include <random>
+
+template<typename T>
+dm::DistanceMatrix<T> make_matrix(size_t n) {
+    dm::DistanceMatrix<T> mat(n);
+    std::mt19937_64 mt(n + sizeof(T));
+    for(auto &x: mat) x = T(mt() % 1000);
+    return mat;
+}
+
+template<typename T>
+void check_knn(const dm::DistanceMatrix<T> &mat, const dm::NeighborTable<T> &table, size_t k, bool largest) {
+    const size_t n = mat.size();
+    assert(table.n == n && table.k == std::min(k, n - 1));
+    for(size_t i = 0; i < n; ++i) {
+        std::vector<std::pair<T, uint64_t>> all;
+        for(size_t j = 0; j < n; ++j)
+            if(j != i) all.emplace_back(mat(i, j), j);
+        std::sort(all.begin(), all.end(), [largest](const auto &a, const auto &b) {
+            return largest ? (a.first > b.first || (a.first == b.first && a.second < b.second)): a < b;
+        });
+        for(size_t r = 0; r < table.k; ++r) {
+            assert(table.distances(i)[r] == all[r].first);
+            assert(table.indices(i)[r] == all[r].second);
+        }
+    }
+}
+
+template<typename T>
+void test_knn(dm::Executor &ex, size_t n) {
+    auto mat = make_matrix<T>(n);
+    for(const size_t k: {0u, 1u, 5u, 30u}) {
+        check_knn(mat, dm::knn(mat, k, ex), k, false);
+        check_knn(mat, dm::knn(mat, k, ex, true), k, true);
+    }
+    mat.write("knn.dm.gz", 1);
+    {
+        dm::DistanceMatrixReader<T> reader("knn.dm.gz", 1 << 10);
+        check_knn(mat, dm::knn(reader, 7, ex), 7, false);
+    }
+    {
+        dm::DistanceMatrixReader<T> reader("knn.dm.gz", 1 << 10);
+        check_knn(mat, dm::knn(reader, 0, ex), 0, false);
+    }
+    dm::RectDistanceMatrix<T> rect(n, n);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = 0; j < n; ++j) rect(i, j) = i == j ? T(0): mat(i, j);
+    const auto none = dm::knn(rect, 0, ex);
+    assert(none.n == n && none.k == 0 && none.neighbor_indices.empty());
+    std::remove("knn.dm.gz");
+}
+
+template<typename T>
+void test_edges(dm::Executor &ex, size_t n) {
+    const auto mat = make_matrix<T>(n);
+    const double cutoff = 20;
+    std::vector<dm::Edge<T>> expected;
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i + 1; j < n; ++j)
+            if(mat(i, j) < cutoff) expected.push_back(dm::Edge<T>{i, j, mat(i, j)});
+    const auto edges = dm::threshold_edges(mat, cutoff, false, ex);
+    assert(edges.size() == expected.size());
+    for(size_t e = 0; e < edges.size(); ++e)
+        assert(edges[e].i == expected[e].i && edges[e].j == expected[e].j && edges[e].dist == expected[e].dist);
+    size_t ninclusive = 0;
+    for(const auto x: mat) ninclusive += x <= cutoff;
+    assert(dm::threshold_edges(mat, cutoff, true, ex).size() == ninclusive);
+
+    assert(dm::write_edges(mat, "edges.bin", cutoff, dm::EdgeFormat::BINARY, false, ex) == expected.size());
+    {
+        std::FILE *fp = std::fopen("edges.bin", "rb");
+        for(const auto &e: expected) {
+            uint64_t i, j;
+            T d;
+            assert(std::fread(&i, sizeof(i), 1, fp) == 1 && std::fread(&j, sizeof(j), 1, fp) == 1 && std::fread(&d, sizeof(d), 1, fp) == 1);
+            assert(i == e.i && j == e.j && d == e.dist);
+        }
+        assert(std::fgetc(fp) == EOF);
+        std::fclose(fp);
+    }
+    assert(dm::write_edges(mat, "edges.txt", cutoff, dm::EdgeFormat::TEXT, false, ex) == expected.size());
+    {
+        std::ifstream ifs("edges.txt");
+        for(const auto &e: expected) {
+            uint64_t i, j;
+            double d;
+            assert(ifs >> i >> j >> d);
+            assert(i == e.i && j == e.j && T(d) == e.dist);
+        }
+        uint64_t extra;
+        assert(!(ifs >> extra));
+    }
+    std::remove("edges.bin");
+    std::remove("edges.txt");
+
+    const auto graph = dm::csr_graph(mat, cutoff, false, ex);
+    assert(graph.n == n && graph.num_edges() == expected.size());
+    for(size_t i = 0; i < n; ++i) {
+        std::vector<uint32_t> nbrs;
+        for(size_t j = 0; j < n; ++j) if(j != i && mat(i, j) < cutoff) nbrs.push_back(j);
+        assert(graph.degree(i) == nbrs.size());
+        for(size_t k = 0; k < nbrs.size(); ++k)
+            assert(graph.neighbors(i)[k] == nbrs[k] && graph.neighbor_weights(i)[k] == mat(i, nbrs[k]));
+    }
+}
+
+template<typename T>
+void test_top_k_pairs(dm::Executor &ex, size_t n) {
+    const auto mat = make_matrix<T>(n);
+    for(const bool largest: {false, true}) {
+        std::vector<dm::Edge<T>> all;
+        for(size_t i = 0; i < n; ++i)
+            for(size_t j = i + 1; j < n; ++j) all.push_back(dm::Edge<T>{i, j, mat(i, j)});
+        std::stable_sort(all.begin(), all.end(), [largest](const dm::Edge<T> &a, const dm::Edge<T> &b) {
+            return largest ? a.dist > b.dist: a.dist < b.dist;
+        });
+        for(const size_t k: {0u, 1u, 17u, 1000u, 1u << 20}) {
+            const auto top = dm::top_k_pairs(mat, k, largest, ex);
+            assert(top.size() == std::min(k, all.size()));
+            for(size_t r = 0; r < top.size(); ++r)
+                assert(top[r].i == all[r].i && top[r].j == all[r].j && top[r].dist == all[r].dist);
+        }
+    }
+}
+
+int main() {
+    dm::ThreadPool pool(4);
+    dm::SerialExecutor serial;
+    for(const size_t n: {2u, 10u, 300u}) {
+        test_knn<float>(pool, n);
+        test_knn<uint16_t>(serial, n);
+    }
+    for(const size_t n: {0u, 1u, 2u, 50u, 700u}) {
+        test_edges<float>(pool, n);
+        test_edges<uint16_t>(serial, n);
+        test_edges<int32_t>(pool, n);
+    }
+    for(const size_t n: {0u, 2u, 40u, 900u}) {
+        test_top_k_pairs<float>(pool, n);
+        test_top_k_pairs<uint16_t>(serial, n);
+        test_top_k_pairs<int64_t>(pool, n);
+    }
+    std::fprintf(stderr, "Passed neighbor tests\n");
+}
@@ -0,0 +1,240 @@
+#include "distmat.h"
+#include <iostream>
+#include <random>
+
+template<typename T>
+dm::DistanceMatrix<T> make_matrix(size_t n) {
+    dm::DistanceMatrix<T> mat(n);
+    std::mt19937_64 mt(n + sizeof(T));
+    for(auto &x: mat) x = T(mt() % 50);
+    return mat;
+}
+
+template<typename T>
+void check_stats(const dm::DistanceMatrix<T> &mat, const dm::PointStats<T> &stats) {
+    const size_t n = mat.size();
+    assert(stats.n == n);
+    for(size_t i = 0; i < n; ++i) {
+        double s = 0., sq = 0.;
+        T mn = dm::numeric_limits<T>::max();
+        uint64_t am = uint64_t(-1);
+        for(size_t j = 0; j < n; ++j) {
+            if(j == i) continue;
+            const T v = mat(i, j);
+            s += v, sq += double(v) * v;
+            if(v < mn) mn = v, am = j;
+        }
+        assert(std::abs(stats.sum[i] - s) <= 1e-9 * std::max(1., s));
+        assert(std::abs(stats.sumsq[i] - sq) <= 1e-9 * std::max(1., sq));
+        assert(stats.min[i] == mn && stats.argmin[i] == am);
+        if(n > 1) {
+            const double mean = s / (n - 1);
+            assert(std::abs(stats.mean(i) - mean) < 1e-9 * std::max(1., mean));
+            assert(std::abs(stats.variance(i) - (sq / (n - 1) - mean * mean)) < 1e-6);
+        }
+    }
+}
+
+template<typename T>
+void test_stats(dm::Executor &ex, size_t n) {
+    auto mat = make_matrix<T>(n);
+    check_stats(mat, dm::point_stats(mat, ex));
+    mat.write("reductions.dm", 0);
+    {
+        dm::DistanceMatrixReader<T> reader("reductions.dm", 1 << 9);
+        check_stats(mat, dm::point_stats(reader, ex));
+    }
+    std::remove("reductions.dm");
+}
+
+double naive_pearson(const std::vector<double> &x, const std::vector<double> &y) {
+    const double m = x.size(), mx = std::accumulate(x.begin(), x.end(), 0.) / m, my = std::accumulate(y.begin(), y.end(), 0.) / m;
+    double sxy = 0., sxx = 0., syy = 0.;
+    for(size_t i = 0; i < x.size(); ++i)
+        sxy += (x[i] - mx) * (y[i] - my), sxx += (x[i] - mx) * (x[i] - mx), syy += (y[i] - my) * (y[i] - my);
+    return sxy / std::sqrt(sxx * syy);
+}
+std::vector<double> naive_ranks(const std::vector<double> &x) {
+    std::vector<double> ret(x.size());
+    for(size_t i = 0; i < x.size(); ++i) {
+        size_t less = 0, equal = 0;
+        for(const auto v: x) less += v < x[i], equal += v == x[i];
+        ret[i] = less + (equal + 1) / 2.;
+    }
+    return ret;
+}
+template<typename T>
+std::vector<double> entries(const dm::DistanceMatrix<T> &mat) {return std::vector<double>(mat.begin(), mat.end());}
+
+void test_correlation(dm::Executor &ex, size_t n) {
+    const auto a = make_matrix<float>(n);
+    dm::DistanceMatrix<uint8_t> b(n);
+    std::mt19937_64 mt(n);
+    for(size_t i = 0; i < b.num_entries(); ++i) b[i] = uint8_t((mt() % 50 + uint8_t(a[i])) / 2);
+    const auto x = entries(a), y = entries(b);
+    assert(std::abs(dm::pearson(a, b, ex) - naive_pearson(x, y)) < 1e-9);
+    assert(std::abs(dm::spearman(a, b, ex) - naive_pearson(naive_ranks(x), naive_ranks(y))) < 1e-9);
+    assert(std::abs(dm::pearson(a, a, ex) - 1.) < 1e-9);
+    auto res = dm::mantel(a, b, 99, dm::CorrelationMethod::PEARSON, 13, ex);
+    assert(std::abs(res.statistic - naive_pearson(x, y)) < 1e-9);
+    assert(res.null_distribution.size() == 99);
+    const size_t nge = std::count_if(res.null_distribution.begin(), res.null_distribution.end(), [&](double r) {return r >= res.statistic - 1e-9;});
+    assert(res.p_value == (nge + 1) / 100.);
+    if(n > 100) assert(res.p_value == 0.01);
+    // Every permuted statistic is the correlation of a with some relabelling of b: enumerate them all for small n.
+    if(n <= 6) {
+        std::vector<uint32_t> perm(n);
+        std::iota(perm.begin(), perm.end(), 0u);
+        std::vector<double> all;
+        do {
+            std::vector<double> py;
+            for(size_t i = 0; i < n; ++i) for(size_t j = i + 1; j < n; ++j) py.push_back(b(perm[i], perm[j]));
+            all.push_back(naive_pearson(x, py));
+        } while(std::next_permutation(perm.begin(), perm.end()));
+        for(const auto r: res.null_distribution)
+            assert(std::any_of(all.begin(), all.end(), [r](double v) {return std::abs(v - r) < 1e-9;}));
+        const size_t ge = std::count_if(all.begin(), all.end(), [&](double v) {return v >= res.statistic - 1e-9;});
+        assert(ge >= 1);
+    }
+    const auto sres = dm::mantel(a, b, 20, dm::CorrelationMethod::SPEARMAN, 13, ex);
+    assert(std::abs(sres.statistic - dm::spearman(a, b, ex)) < 1e-9);
+    // The same seed gives the same permutations whatever the executor.
+    dm::SerialExecutor serial;
+    const auto sres2 = dm::mantel(a, b, 20, dm::CorrelationMethod::SPEARMAN, 13, serial);
+    for(size_t i = 0; i < 20; ++i) assert(std::abs(sres.null_distribution[i] - sres2.null_distribution[i]) < 1e-9);
+}
+
+template<typename T>
+void test_distribution(dm::Executor &ex, size_t n) {
+    const auto mat = make_matrix<T>(n);
+    std::vector<double> sorted(mat.begin(), mat.end());
+    std::sort(sorted.begin(), sorted.end());
+    const size_t m = sorted.size();
+    mat.write("distribution.dm", 6);
+    auto check_hist = [&](const dm::Histogram &h) {
+        assert(h.nbins() == 7 && h.total() == m);
+        std::vector<uint64_t> counts(7);
+        uint64_t below = 0, above = 0;
+        for(const auto v: sorted) {
+            if(v < 5.) ++below;
+            else if(v > 40.) ++above;
+            else ++counts[std::min(size_t((v - 5.) / 5.), size_t(6))];
+        }
+        assert(h.counts == counts && h.below == below && h.above == above);
+    };
+    auto check_sketch = [&](const dm::QuantileSketch<T> &sk) {
+        assert(sk.size() == m);
+        if(!m) return;
+        assert(sk.quantile(0.) == sorted.front() && sk.quantile(1.) == sorted.back());
+        for(const double q: {0.01, 0.1, 0.5, 0.9, 0.99}) {
+            const double v = sk.quantile(q);
+            const double lo = std::lower_bound(sorted.begin(), sorted.end(), v) - sorted.begin();
+            const double hi = std::upper_bound(sorted.begin(), sorted.end(), v) - sorted.begin();
+            // The true rank range of the returned value must come within the sketch's error of q.
+            assert(lo / m <= q + 0.03 && hi / m >= q - 0.03);
+        }
+    };
+    check_hist(dm::histogram(mat, 7, 5., 40., ex));
+    auto sk = dm::quantile_sketch(mat, 200, 1, ex);
+    check_sketch(sk);
+    assert(sk.num_retained() < 2000 || m < 2000);
+    const size_t exact = std::lower_bound(sorted.begin(), sorted.end(), 20.) - sorted.begin();
+    const size_t exact_inclusive = std::upper_bound(sorted.begin(), sorted.end(), 20.) - sorted.begin();
+    assert(dm::count_below(mat, 20., false, ex) == exact);
+    assert(dm::count_below(mat, 20., true, ex) == exact_inclusive);
+    {
+        dm::DistanceMatrixReader<T> reader("distribution.dm", 1 << 12);
+        check_hist(dm::histogram(reader, 7, 5., 40., ex));
+    }
+    {
+        dm::DistanceMatrixReader<T> reader("distribution.dm", 1 << 12);
+        check_sketch(dm::quantile_sketch(reader, 200, 1, ex));
+    }
+    {
+        dm::DistanceMatrixReader<T> reader("distribution.dm", 1 << 12);
+        assert(dm::count_below(reader, 20., false, ex) == exact);
+    }
+    std::remove("distribution.dm");
+}
+
+void test_sketch_merge() {
+    dm::QuantileSketch<double> a(100, 1), b(100, 2), all(100, 3);
+    for(size_t i = 0; i < 100000; ++i) {
+        const double v = double((i * 7919) % 100000);
+        (i % 3 ? a: b).update(v);
+        all.update(v);
+    }
+    a.merge(b);
+    assert(a.size() == 100000);
+    for(const double q: {0.05, 0.25, 0.5, 0.75, 0.95}) {
+        assert(std::abs(a.quantile(q) / 100000. - q) < 0.05);
+        assert(std::abs(all.quantile(q) / 100000. - q) < 0.05);
+        assert(std::abs(a.rank(q * 100000.) - q) < 0.05);
+    }
+}
+
+// Distances between random points in dim dimensions, so PCoA in dim dimensions reproduces them.
+dm::DistanceMatrix<double> euclidean(size_t n, size_t dim, std::vector<double> &pts) {
+    std::mt19937_64 mt(n * dim);
+    std::normal_distribution<double> gauss;
+    pts.resize(n * dim);
+    for(size_t i = 0; i < n * dim; ++i) pts[i] = gauss(mt) * double(dim - i % dim);
+    dm::DistanceMatrix<double> mat(n);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i + 1; j < n; ++j) {
+            double s = 0.;
+            for(size_t d = 0; d < dim; ++d) s += (pts[i * dim + d] - pts[j * dim + d]) * (pts[i * dim + d] - pts[j * dim + d]);
+            mat(i, j) = std::sqrt(s);
+        }
+    return mat;
+}
+
+void test_pcoa(dm::Executor &ex, size_t n) {
+    std::vector<double> pts;
+    const size_t dim = 3;
+    const auto mat = euclidean(n, dim, pts);
+    const auto res = dm::pcoa(mat, dim, 5, 10, 1, ex);
+    const size_t k = std::min(dim, n);
+    assert(res.n == n && res.k == k && res.coordinates.size() == n * k);
+    for(size_t e = 1; e < k; ++e) assert(res.eigenvalues[e - 1] >= res.eigenvalues[e]);
+    if(n > dim) assert(std::abs(std::accumulate(res.proportion_explained.begin(), res.proportion_explained.end(), 0.) - 1.) < 1e-6);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i + 1; j < n; ++j) {
+            double s = 0.;
+            for(size_t d = 0; d < k; ++d) s += (res.point(i)[d] - res.point(j)[d]) * (res.point(i)[d] - res.point(j)[d]);
+            assert(std::abs(std::sqrt(s) - mat(i, j)) < 1e-6 * std::max(1., mat(i, j)));
+        }
+    // Fewer axes than the data has: the leading ones match the full solution.
+    if(n > dim) {
+        const auto top = dm::pcoa(mat, 1, 8, 10, 2, ex);
+        assert(std::abs(top.eigenvalues[0] - res.eigenvalues[0]) < 1e-6 * res.eigenvalues[0]);
+        for(size_t i = 0; i < n; ++i) assert(std::abs(top.point(i)[0] - res.point(i)[0]) < 1e-4 * std::max(1., std::abs(res.point(i)[0])));
+    }
+}
+
+int main() {
+    dm::ThreadPool pool(4);
+    dm::SerialExecutor serial;
+    for(const size_t n: {1u, 2u, 37u, 400u}) {
+        test_stats<float>(pool, n);
+        test_stats<double>(serial, n);
+        test_stats<uint8_t>(pool, n);
+        test_stats<int32_t>(pool, n);
+        test_stats<uint64_t>(serial, n);
+    }
+    for(const size_t n: {5u, 6u, 120u}) {
+        test_correlation(pool, n);
+        test_correlation(serial, n);
+    }
+    for(const size_t n: {0u, 1u, 2u, 90u, 1500u}) {
+        test_distribution<float>(pool, n);
+        test_distribution<uint8_t>(serial, n);
+        test_distribution<int32_t>(pool, n);
+    }
+    test_sketch_merge();
+    for(const size_t n: {0u, 1u, 2u, 3u, 10u, 400u}) {
+        test_pcoa(pool, n);
+        test_pcoa(serial, n);
+    }
+    std::fprintf(stderr, "Passed reduction tests\n");
+}
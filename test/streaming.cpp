@@ -0,0 +1,166 @@
+#include "distmat.h"
+#include <iostream>
+#include <random>
+
+template<typename T>
+T pair_value(uint64_t x, uint64_t y) {return T((x * 131 + y * 7) % 97);}
+
+template<typename T>
+void test_stream_fill(dm::Executor &ex, size_t n, size_t bs, int level) {
+    const char *path = "stream_fill.dm";
+    dm::Instrumentation ins;
+    dm::stream_fill<T>(path, n, pair_value<T>, bs, level, ex, &ins);
+    assert(ins.counters.pairs_computed == n * (n - 1) / 2);
+    dm::DistanceMatrix<T> mat(path);
+    assert(mat.size() == n);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i + 1; j < n; ++j)
+            assert(mat(i, j) == pair_value<T>(j, i));
+    std::remove(path);
+}
+
+template<typename T>
+void test_writer(dm::Executor &ex, size_t n, int level, size_t nproducers) {
+    const char *path = "writer.dm";
+    dm::DistanceMatrix<T> mat(n);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i + 1; j < n; ++j)
+            mat(i, j) = pair_value<T>(j, i);
+    {
+        // Each producer takes every nproducers-th row, so rows arrive out of order.
+        dm::DistanceMatrixWriter<T> writer(path, n, level, 8, ex, nullptr, 1 << 12);
+        writer.set_producers(nproducers);
+        std::vector<std::thread> producers;
+        for(size_t p = 0; p < nproducers; ++p) {
+            producers.emplace_back([&,p]() {
+                for(size_t i = nproducers - 1 - p; i < n; i += nproducers)
+                    writer.append_row(i, mat.row_span(i));
+            });
+        }
+        for(auto &t: producers) t.join();
+        writer.finish();
+    }
+    dm::DistanceMatrix<T> read_back(path);
+    assert(read_back == mat);
+    bool caught = false;
+    try {
+        dm::DistanceMatrixWriter<T> writer(path, n, level, 8, ex);
+        writer.append_row(0, mat.row_span(0));
+        writer.finish();
+    } catch(const std::runtime_error &) {caught = true;}
+    assert(caught || n <= 2);
+    if(n > 10) {
+        // A single producer skipping a row gets an error once it runs max_reorder rows ahead, not a hang,
+        // and can still finish the matrix by appending the missing row.
+        dm::DistanceMatrixWriter<T> writer(path, n, level, 8, ex);
+        writer.append_row(0, mat.row_span(0));
+        for(size_t i = 2; i < 9; ++i) writer.append_row(i, mat.row_span(i));
+        caught = false;
+        try {
+            writer.append_row(9, mat.row_span(9));
+        } catch(const std::out_of_range &) {caught = true;}
+        assert(caught);
+        for(size_t i = 1; i < n; ++i)
+            if(i == 1 || i >= 9) writer.append_row(i, mat.row_span(i));
+        writer.finish();
+        assert(dm::DistanceMatrix<T>(path) == mat);
+    }
+    std::remove(path);
+}
+
+template<typename T>
+void test_reader(dm::Executor &ex, size_t n, int level, size_t batch_bytes) {
+    const char *path = "reader.dm";
+    dm::stream_fill<T>(path, n, pair_value<T>, 7, level, ex);
+    {
+        dm::DistanceMatrixReader<T> reader(path, batch_bytes, 2);
+        assert(reader.size() == n);
+        size_t expected_row = 0, i;
+        std::pair<const T *, size_t> span;
+        while(reader.next_row(i, span)) {
+            assert(i == expected_row++);
+            assert(span.second == n - i - 1);
+            for(size_t j = 0; j < span.second; ++j)
+                assert(span.first[j] == pair_value<T>(i + j + 1, i));
+        }
+        assert(expected_row == n);
+    }
+    {
+        // Stop early: the destructor must not hang on a full read-ahead queue.
+        dm::DistanceMatrixReader<T> reader(path, 64, 1);
+        typename dm::DistanceMatrixReader<T>::RowBatch batch;
+        if(n > 1) assert(reader.next(batch) && batch.first_row() == 0);
+    }
+    std::remove(path);
+}
+
+// Runs tasks inline like SerialExecutor, except that async task number fail_at stays pending until fail().
+class FailingExecutor: public dm::SerialExecutor {
+    size_t ncalls_ = 0, fail_at_;
+    std::promise<void> pending_;
+public:
+    explicit FailingExecutor(size_t fail_at): fail_at_(fail_at) {}
+    std::future<void> async(std::function<void()> func) override {
+        if(ncalls_++ == fail_at_) return pending_.get_future();
+        return dm::SerialExecutor::async(std::move(func));
+    }
+    void fail() {pending_.set_exception(std::make_exception_ptr(std::runtime_error("injected failure")));}
+};
+
+void test_block_writer_failure() {
+    const char *path = "failing_writer.gz";
+    const size_t nblocks = 8, fail_at = 2, nb = 1 << 16;
+    std::vector<std::vector<char>> blocks(nblocks, std::vector<char>(nb));
+    for(size_t b = 0; b < nblocks; ++b)
+        for(size_t i = 0; i < nb; ++i) blocks[b][i] = char((i * 31 + b * 7) % 251);
+    // Compressing block fail_at fails once every block is queued: only the blocks before it may reach the file.
+    FailingExecutor ex(fail_at);
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    bool caught = false;
+    try {
+        dm::AsyncBlockWriter writer(fd, 1, ex, nblocks);
+        for(const auto &block: blocks) writer.push(block.data(), nb);
+        ex.fail();
+        writer.finish();
+    } catch(const std::runtime_error &) {caught = true;}
+    assert(caught);
+    ::close(fd);
+    size_t expected = 0;
+    for(size_t b = 0; b < fail_at; ++b) expected += dm::detail::gzip_member(blocks[b].data(), nb, 1).size();
+    struct stat st;
+    assert(::stat(path, &st) == 0 && size_t(st.st_size) == expected);
+    // A descriptor that can't be written to fails the first write, and nothing is written after it.
+    fd = ::open(path, O_RDONLY);
+    assert(fd >= 0);
+    caught = false;
+    try {
+        dm::SerialExecutor serial;
+        dm::AsyncBlockWriter writer(fd, 0, serial, 2);
+        for(const auto &block: blocks) writer.push(block.data(), nb);
+        writer.finish();
+    } catch(const std::system_error &) {caught = true;}
+    assert(caught);
+    ::close(fd);
+    std::remove(path);
+}
+
+int main() {
+    dm::ThreadPool pool(4);
+    dm::SerialExecutor serial;
+    for(dm::Executor *ex: {static_cast<dm::Executor *>(&pool), static_cast<dm::Executor *>(&serial)}) {
+        for(const size_t n: {2u, 3u, 100u, 1001u}) {
+            test_stream_fill<float>(*ex, n, 1, 0);
+            test_stream_fill<double>(*ex, n, 16, 1);
+            test_stream_fill<uint16_t>(*ex, n, 200, 6);
+            test_writer<float>(*ex, n, 0, 1);
+            test_writer<double>(*ex, n, 0, 3);
+            test_writer<int32_t>(*ex, n, 5, 4);
+            test_reader<float>(*ex, n, 0, 1);
+            test_reader<double>(*ex, n, 3, 1 << 12);
+            test_reader<uint8_t>(*ex, n, 0, 1 << 20);
+        }
+    }
+    test_block_writer_failure();
+    std::fprintf(stderr, "Passed streaming tests\n");
+}
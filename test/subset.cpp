@@ -0,0 +1,79 @@
+#include "distmat.h"
+#include <iostream>
+#include <random>
+
+template<typename T>
+dm::DistanceMatrix<T> make_matrix(size_t n) {
+    dm::DistanceMatrix<T> mat(n);
+    std::mt19937_64 mt(n + sizeof(T));
+    for(auto &x: mat) x = T(mt() % 10000);
+    return mat;
+}
+
+template<typename T>
+void check_subset(const dm::DistanceMatrix<T> &mat, const dm::DistanceMatrix<T> &sub, const std::vector<size_t> &idx) {
+    assert(sub.size() == idx.size());
+    for(size_t a = 0; a < idx.size(); ++a)
+        for(size_t b = 0; b < idx.size(); ++b)
+            if(a != b) assert(sub(a, b) == mat(idx[a], idx[b]));
+}
+
+template<typename T>
+void test_subset(dm::Executor &ex, size_t n) {
+    auto mat = make_matrix<T>(n);
+    std::mt19937_64 mt(n);
+    std::vector<size_t> idx;
+    for(size_t i = 0; i < n / 3; ++i) idx.push_back(mt() % n);
+    idx.push_back(idx.front()); // duplicates must work
+    check_subset(mat, mat.subset(idx, ex), idx);
+    std::vector<size_t> sorted_idx(idx);
+    std::sort(sorted_idx.begin(), sorted_idx.end());
+    check_subset(mat, mat.subset(sorted_idx, ex), sorted_idx);
+    mat.write("subset.dm.gz", 2);
+    {
+        dm::DistanceMatrixReader<T> reader("subset.dm.gz", 1 << 10);
+        check_subset(mat, dm::subset(reader, idx, ex), idx);
+    }
+    std::remove("subset.dm.gz");
+    bool caught = false;
+    try {
+        mat.subset(std::vector<size_t>{n}, ex);
+    } catch(const std::out_of_range &) {caught = true;}
+    assert(caught);
+}
+
+template<typename T>
+void test_permute(dm::Executor &ex, size_t n) {
+    auto mat = make_matrix<T>(n);
+    std::vector<size_t> perm(n);
+    for(size_t i = 0; i < n; ++i) perm[i] = i;
+    std::shuffle(perm.begin(), perm.end(), std::mt19937_64(n));
+    auto out = mat.permuted(perm, ex);
+    check_subset(mat, out, perm);
+    mat.permute(perm);
+    assert(mat == out);
+    // A single long cycle.
+    for(size_t i = 0; i < n; ++i) perm[i] = (i + 1) % n;
+    auto out2 = mat.permuted(perm, ex);
+    check_subset(mat, out2, perm);
+    mat.permute(perm);
+    assert(mat == out2);
+    bool caught = false;
+    perm[0] = perm[1];
+    try {
+        mat.permute(perm);
+    } catch(const std::invalid_argument &) {caught = true;}
+    assert(caught || n < 2);
+}
+
+int main() {
+    dm::ThreadPool pool(4);
+    dm::SerialExecutor serial;
+    for(const size_t n: {3u, 50u, 701u}) {
+        test_subset<float>(pool, n);
+        test_subset<uint16_t>(serial, n);
+        test_permute<double>(pool, n);
+        test_permute<int8_t>(serial, n);
+    }
+    std::fprintf(stderr, "Passed subset tests\n");
+}
@@ -0,0 +1,117 @@
+#include "distmat.h"
+#include <iostream>
+#include <random>
+
+template<typename T>
+dm::DistanceMatrix<T> make_matrix(size_t n) {
+    dm::DistanceMatrix<T> mat(n);
+    std::mt19937_64 mt(n + sizeof(T));
+    std::uniform_real_distribution<double> urd(0.01, 1.);
+    for(auto &x: mat) x = T(urd(mt));
+    return mat;
+}
+
+bool close(double a, double b) {return std::abs(a - b) <= 1e-5 * std::max(1., std::abs(a));}
+
+void test_apply(dm::Executor &ex, size_t n) {
+    const auto jac = make_matrix<double>(n);
+    auto mash = jac;
+    mash.apply(dm::transforms::JaccardToMash{21}, ex);
+    for(size_t i = 0; i < jac.num_entries(); ++i)
+        assert(close(mash[i], std::min(1., -std::log(2. * jac[i] / (1. + jac[i])) / 21)));
+    auto back = mash.transform_into<float>(dm::transforms::MashToJaccard{21}, ex);
+    for(size_t i = 0; i < jac.num_entries(); ++i)
+        assert(close(back[i], jac[i]));
+    auto sim = jac;
+    sim.set_default_value(1.);
+    sim.apply(dm::transforms::OneMinus(), ex);
+    assert(sim(0, 0) == 0.);
+    for(size_t i = 0; i < jac.num_entries(); ++i) assert(sim[i] == 1. - jac[i]);
+    sim.apply(dm::transforms::Clamp{0.2, 0.5}, ex);
+    for(const auto x: sim) assert(x >= 0.2 && x <= 0.5);
+    std::vector<double> cards(n);
+    for(size_t i = 0; i < n; ++i) cards[i] = 100. + i;
+    auto cont = jac;
+    cont.apply_indexed(dm::transforms::JaccardToContainment{cards}, ex);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = i + 1; j < n; ++j)
+            assert(close(cont(i, j), jac(i, j) * (cards[i] + cards[j]) / (1. + jac(i, j)) / std::min(cards[i], cards[j])));
+    cont.apply_indexed(dm::transforms::ContainmentToJaccard{cards}, ex);
+    for(size_t i = 0; i < jac.num_entries(); ++i) assert(close(cont[i], jac[i]));
+    // Transform straight into a new file-backed matrix.
+    std::remove("transform.dm");
+    {
+        dm::DistanceMatrix<float> out("transform.dm", n);
+        jac.transform_into(out, dm::transforms::Scale{2.}, ex);
+    }
+    dm::DistanceMatrix<float> loaded("transform.dm");
+    for(size_t i = 0; i < jac.num_entries(); ++i) assert(close(loaded[i], 2. * jac[i]));
+    std::remove("transform.dm");
+}
+
+void test_saturating_cast() {
+    using dm::detail::saturating_cast;
+    assert(saturating_cast<uint16_t>(0.4567, 1000.) == 457);
+    assert(saturating_cast<uint16_t>(0.4564, 1000.) == 456);
+    assert(saturating_cast<uint16_t>(-3., 1.) == 0);
+    assert(saturating_cast<uint16_t>(1e9, 1.) == 65535);
+    assert(saturating_cast<uint16_t>(std::numeric_limits<double>::quiet_NaN(), 1.) == 65535);
+    assert(saturating_cast<int8_t>(-2.5, 1.) == -3 && saturating_cast<int8_t>(-1000., 1.) == -128);
+    assert(saturating_cast<int64_t>(1e30, 1.) == std::numeric_limits<int64_t>::max());
+    assert(saturating_cast<uint64_t>(1.8446744073709552e19, 1.) == std::numeric_limits<uint64_t>::max());
+    assert(saturating_cast<int8_t>(int64_t(-300), 1.) == -128 && saturating_cast<int8_t>(uint64_t(300), 1.) == 127);
+    assert(saturating_cast<uint32_t>(int32_t(-1), 1.) == 0 && saturating_cast<int32_t>(uint64_t(-1), 1.) == std::numeric_limits<int32_t>::max());
+    assert(saturating_cast<uint64_t>(uint64_t(-1), 1.) == uint64_t(-1));
+    assert(saturating_cast<int64_t>(-(__int128_t(1) << 100), 1.) == std::numeric_limits<int64_t>::min());
+    assert(saturating_cast<__uint128_t>(uint64_t(-1), 1.) == __uint128_t(uint64_t(-1)));
+    assert(saturating_cast<float>(uint8_t(7), .5) == 3.5f);
+}
+
+void test_convert(dm::Executor &ex, size_t n) {
+    const auto mat = make_matrix<double>(n);
+    const auto f = mat.convert<float>(1., ex);
+    for(size_t i = 0; i < mat.num_entries(); ++i) assert(f[i] == float(mat[i]));
+    const auto fixed = mat.convert<uint16_t>(1000., ex);
+    for(size_t i = 0; i < mat.num_entries(); ++i) assert(fixed[i] == uint16_t(std::floor(mat[i] * 1000. + .5)));
+    const auto back = fixed.convert<double>(1e-3, ex);
+    for(size_t i = 0; i < mat.num_entries(); ++i) assert(std::abs(back[i] - mat[i]) <= 5e-4 + 1e-12);
+    auto big = mat;
+    big.apply(dm::transforms::Scale{1000.}, ex);
+    const auto bytes = big.convert<uint8_t>(1., ex);
+    for(size_t i = 0; i < mat.num_entries(); ++i) assert(bytes[i] == (big[i] >= 254.5 ? 255: uint8_t(std::floor(big[i] + .5))));
+
+    std::remove("convert_in.dm.gz");
+    std::remove("convert_out.dm");
+    mat.write("convert_in.dm.gz", 1);
+    dm::convert_file<float>("convert_in.dm.gz", "convert_out.dm", 1., 0, ex, 1 << 12);
+    {
+        dm::DistanceMatrix<float> loaded("convert_out.dm");
+        assert(loaded.size() == n);
+        for(size_t i = 0; i < mat.num_entries(); ++i) assert(loaded[i] == f[i]);
+    }
+    dm::convert_file("convert_out.dm", "convert_in.dm.gz", dm::more_magic::UINT16_T, 1000., 6, ex, 1 << 10);
+    {
+        dm::DistanceMatrix<uint16_t> loaded("convert_in.dm.gz");
+        for(size_t i = 0; i < mat.num_entries(); ++i) assert(loaded[i] == dm::detail::saturating_cast<uint16_t>(f[i], 1000.));
+    }
+    bool threw = false;
+    try {
+        dm::convert_file<float>("convert_missing.dm", "convert_out.dm");
+    } catch(const std::runtime_error &) {threw = true;}
+    assert(threw);
+    std::remove("convert_in.dm.gz");
+    std::remove("convert_out.dm");
+}
+
+int main() {
+    dm::ThreadPool pool(4);
+    dm::SerialExecutor serial;
+    for(const size_t n: {2u, 50u, 1000u}) {
+        test_apply(pool, n);
+        test_apply(serial, n);
+        test_convert(pool, n);
+        test_convert(serial, n);
+    }
+    test_saturating_cast();
+    std::fprintf(stderr, "Passed transform tests\n");
+}